@@ -8,10 +8,51 @@ KeypadTask keypad;
 Display lc_display;
 SevenSegEventHandler seven_segment;
 
+// compile-time message routes (routes.cpp)
+extern const Kernel::MQROUTETABLE AppRoutes;
+
+// how often the kernel prints the per-task CPU profile to Serial (0 = never)
+#define PROFILE_DUMP_MS 30000UL
+
+// set to 1 to print the I2C read throughput of each device at start-up
+#define IIC_BENCHMARK 0
+
+#if IIC_BENCHMARK
+// reads 32 transfers of 16 bytes and prints address, SCL Hz and bytes/s
+static void IICBenchmark(unsigned char addr)
+{
+  unsigned char buf[16];
+
+  Serial.print("IIC,BENCH,");
+  Serial.print(addr, HEX);
+  Serial.print(',');
+  Serial.print(Kernel::OS.IICDriver.GetSpeed(addr));
+  Serial.print(',');
+  Serial.println(Kernel::OS.IICDriver.Benchmark(addr, buf, sizeof(buf), 32));
+}
+#endif
+
 void UserInit()
 {
   Serial.begin(115200);
+
+  Kernel::OS.MessageQueue.SetStaticRoutes(&AppRoutes);
+
+  // drain the message queue within a budget that grows with its depth
+  Kernel::OS.SetSchedPolicy(Kernel::KSCHED_ADAPTIVE, 2000);
+
+  // operator input and speed changes must never wait behind logging
+  Kernel::OS.MessageQueue.SetPriority(MSG_ID_NEW_RPS_ENTERED, Kernel::MQ_PRIORITY_CONTROL);
+  Kernel::OS.MessageQueue.SetPriority(MSG_ID_NEW_DEMAND_RPS, Kernel::MQ_PRIORITY_CONTROL);
+  Kernel::OS.MessageQueue.SetPriority(MSG_ID_DATALOG_LOGEVENT, Kernel::MQ_PRIORITY_BACKGROUND);
+  Kernel::OS.MessageQueue.SetPriority(MSG_ID_DATALOG_DELETELOG, Kernel::MQ_PRIORITY_BACKGROUND);
+  Kernel::OS.MessageQueue.SetPriority(MSG_ID_DATALOG_DUMPLOG, Kernel::MQ_PRIORITY_BACKGROUND);
+
+  // state-style topics: only the latest value is worth dispatching
+  Kernel::OS.MessageQueue.SetCoalesce(MSG_ID_NEW_ACTUAL_RPS, true);
+  Kernel::OS.MessageQueue.SetCoalesce(MSG_ID_UPDATE_7SEG, true);
   
+  lc_display.SetPriority(Display::TASK_PRIO);
   lc_display.Start();
 
   RPS::Init();
@@ -20,7 +61,27 @@ void UserInit()
 
   logger.Start();
 
-  control.Start();
+  // the control loop is the most urgent periodic task
+  control.Start(Control::CONTROL_TICK_MS, Control::TASK_PRIO);
+
+  lc_display.SetName("display");
+  keypad.SetName("keypad");
+  logger.SetName("log");
+  control.SetName("control");
+  Kernel::OS.SetProfileDump(&Serial, PROFILE_DUMP_MS);
+
+  // a stalled control loop or keypad scan resets the board, which also
+  // stops the motor; the display only has its run time checked
+  control.Watch(4 * Control::CONTROL_TICK_MS, 50);
+  keypad.Watch(500, 20);
+  lc_display.Watch(0, 100);
+  Kernel::OS.SetWatchdogLog(&Serial);
+
+#if IIC_BENCHMARK
+  IICBenchmark(0xA0);   // E2
+  IICBenchmark(0xDE);   // RTC
+  IICBenchmark(0x40);   // keypad port expander
+#endif
 
   if (logger.SetDate(3, 12, 2, 10, 10, 10))
     return;
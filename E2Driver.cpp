@@ -6,13 +6,15 @@ int E2Driver::memory_write(uint16_t _page_address, const uint8_t *_input_data, u
   if (!_data_length || (_page_address > this->E2_LAST_ADDRESS) || (_data_length > this->E2_PAGE_SIZE))
     return -1;
 
-  DATA_BUFFER load;
+  unsigned char address[2];
 
-  load.page_address[0] = (_page_address * this->E2_PAGE_SIZE) >> 8;
-  load.page_address[1] = _page_address * this->E2_PAGE_SIZE;
+  address[0] = (_page_address * this->E2_PAGE_SIZE) >> 8;
+  address[1] = _page_address * this->E2_PAGE_SIZE;
 
-  memcpy(load.data, _input_data, _data_length);
-  return Kernel::OS.IICDriver.IICWrite(this->E2_IIC_ADDRESS, (unsigned char *)&load, _data_length + 2);
+  // send the address and the caller's data as one write, without copying it
+  Kernel::IICSEG segs[2] = {{address, 2}, {_input_data, _data_length}};
+
+  return Kernel::OS.IICDriver.WriteV(this->E2_IIC_ADDRESS, segs, 2);
 }
 
 
@@ -23,10 +25,52 @@ int E2Driver::memory_read(uint16_t _page_address, uint8_t* _output_data, uint8_t
 
   char address[2] = {(_page_address * this->E2_PAGE_SIZE) >> 8, _page_address * this->E2_PAGE_SIZE};
 
-  if (Kernel::OS.IICDriver.IICWrite(this->E2_IIC_ADDRESS, address, 2))
-    return -1;
-  if (Kernel::OS.IICDriver.IICRead(this->E2_IIC_ADDRESS, (unsigned char *)_output_data, _data_length))
+  // set the address pointer and read from it in one transaction
+  if (Kernel::OS.IICDriver.WriteRead(this->E2_IIC_ADDRESS, (unsigned char *)address, 2, (unsigned char *)_output_data, _data_length))
     return -1;
     
   return 0;
 }
+
+
+int E2Driver::memory_write_async(uint16_t _page_address, const uint8_t *_input_data, uint8_t _data_length, int _message_id)
+{
+  if (!_data_length || (_page_address > this->E2_LAST_ADDRESS) || (_data_length > this->E2_PAGE_SIZE)
+      || (this->xfer.Status == IIC_PENDING))
+    return -1;
+
+  this->xfer_address[0] = (_page_address * this->E2_PAGE_SIZE) >> 8;
+  this->xfer_address[1] = _page_address * this->E2_PAGE_SIZE;
+
+  this->xfer_segs[0] = {this->xfer_address, 2};
+  this->xfer_segs[1] = {_input_data, _data_length};
+
+  this->xfer = {};
+  this->xfer.Addr = this->E2_IIC_ADDRESS;
+  this->xfer.pTxSegs = this->xfer_segs;
+  this->xfer.nTxSegs = 2;
+  this->xfer.MsgId = _message_id;
+
+  return Kernel::OS.IICDriver.Submit(&this->xfer);
+}
+
+
+int E2Driver::memory_read_async(uint16_t _page_address, uint8_t* _output_data, uint8_t _data_length, int _message_id)
+{
+  if (!_data_length || (_page_address > this->E2_LAST_ADDRESS) || (_data_length > this->E2_PAGE_SIZE)
+      || (this->xfer.Status == IIC_PENDING))
+    return -1;
+
+  this->xfer_address[0] = (_page_address * this->E2_PAGE_SIZE) >> 8;
+  this->xfer_address[1] = _page_address * this->E2_PAGE_SIZE;
+
+  this->xfer = {};
+  this->xfer.Addr = this->E2_IIC_ADDRESS;
+  this->xfer.pTx = this->xfer_address;
+  this->xfer.nTx = 2;
+  this->xfer.pRx = _output_data;
+  this->xfer.nRx = _data_length;
+  this->xfer.MsgId = _message_id;
+
+  return Kernel::OS.IICDriver.Submit(&this->xfer);
+}
@@ -15,17 +15,19 @@ class E2Driver {
     static constexpr uint16_t E2_MEMORY_SIZE = 65535;
     static constexpr unsigned char E2_DEFAULT_IIC_ADDRESS = 0;
 
+    // 24LC512: 400 kHz at 2.5 V and above
+    static constexpr unsigned long E2_MAX_IIC_HZ = 400000;
+
   protected:
     const unsigned char E2_IIC_ADDRESS;
     static constexpr uint8_t E2_PAGE_SIZE = 64;
     static constexpr uint16_t E2_LAST_ADDRESS = E2_MEMORY_SIZE / E2_PAGE_SIZE;
 
-    struct DATA_BUFFER
-    {
-      unsigned char page_address[2];
-      char data[E2_PAGE_SIZE];
-    };
-
+  private:
+    // the one transfer the *_async calls keep on the bus
+    Kernel::IICXFER xfer = {};
+    unsigned char xfer_address[2];
+    Kernel::IICSEG xfer_segs[2];
 
   public:
     // custom constructor : takes E2 address ->
@@ -36,6 +38,8 @@ class E2Driver {
       static_assert(E2_PAGE_SIZE > 0, "E2 page size has to be more than 0");
       static_assert(E2_PAGE_SIZE <= 128, "E2 page size has to be less than 128");
       static_assert(E2_PAGE_SIZE && !(E2_PAGE_SIZE & (E2_PAGE_SIZE - 1)), "E2 page size has to be a power of 2");
+
+      Kernel::IIC::Get().SetDeviceSpeed(this->E2_IIC_ADDRESS, E2_MAX_IIC_HZ);
     };
 
     // write to eeprom : takes page address and input data ->
@@ -43,6 +47,16 @@ class E2Driver {
     
     // reads specific page : takes page address
     int memory_read(uint16_t _page_address = 0, uint8_t *_output_data  = (unsigned char*)"error", uint8_t _data_length = E2_PAGE_SIZE);
+
+    // as memory_write/memory_read, but return once the transfer is queued.
+    // The data must stay in place until transfer_status is no longer
+    // IIC_PENDING; _message_id (or IIC_NO_MSG) is posted when it is done.
+    // Only one transfer at a time: -1 while the last is still pending
+    int memory_write_async(uint16_t _page_address, const uint8_t *_input_data, uint8_t _data_length, int _message_id);
+    int memory_read_async(uint16_t _page_address, uint8_t *_output_data, uint8_t _data_length, int _message_id);
+
+    // IIC_PENDING while on the bus, then IIC_OK or an IIC_ERR_ code
+    int transfer_status() const { return this->xfer.Status; }
 };
 
 
@@ -2,6 +2,8 @@
 
 KeypadTask::KeypadTask() : key_state(KEY_IDLE)
 {
+  Kernel::IIC::Get().SetDeviceSpeed(this->KEYPAD_DEFAULT_IIC_ADDRESS, KEYPAD_MAX_IIC_HZ);
+
   // set bottom 3 pins (GPIA0, GPIAO1, GPIAO3) as outputs
   unsigned char iicreg[2] = {0x00, 0xf8};
   Kernel::OS.IICDriver.IICWrite(this->KEYPAD_DEFAULT_IIC_ADDRESS, iicreg, 2);
@@ -14,20 +16,26 @@ KeypadTask::KeypadTask() : key_state(KEY_IDLE)
   iicreg[0] = 0x02; iicreg[1] = 0x78;
   Kernel::OS.IICDriver.IICWrite(this->KEYPAD_DEFAULT_IIC_ADDRESS, iicreg, 2);
 
-  // register MCP23017
-  Kernel::OS.TaskManager.RegisterTaskHandler(this);
+  // scan the MCP23017 every KEYPAD_POLL_MS, and once the debounce delay is up
+  this->WakeOnMessage(MSG_ID_KEY_DEBOUNCED);
 
-  Start();
+  Start(this->KEYPAD_POLL_MS, this->TASK_PRIO);
 }
 
 
 void KeypadTask::TaskLoop(void)
 {
   unsigned char iicreg[2]; iicreg[0] = 0x12;
-  unsigned char registered_key;
+  unsigned char registered_key = 0;
+
+  // read GPIOA (register 0x12) in one transaction
+  int rc = Kernel::OS.IICDriver.WriteRead(this->KEYPAD_DEFAULT_IIC_ADDRESS, iicreg, 1, &registered_key, 1);
+  this->Heartbeat();
 
-  Kernel::OS.IICDriver.IICWrite(this->KEYPAD_DEFAULT_IIC_ADDRESS, iicreg, 1);
-  Kernel::OS.IICDriver.IICRead(this->KEYPAD_DEFAULT_IIC_ADDRESS, &registered_key, 1);
+  // a failed read (NACK, timeout, bus recovery) says nothing about the keys:
+  // keep the current state and try again on the next poll
+  if (rc)
+    return;
 
   switch (key_state)
   {
@@ -38,7 +46,10 @@ void KeypadTask::TaskLoop(void)
       {
         if (registered_key & 0b01111000)
         {
-          this->key_timer.Set(20);
+          this->debounced = false;
+          this->press_start_us = Kernel::TimerService::Now();
+          Kernel::OS.MessageQueue.CancelTimers(MSG_ID_KEY_DEBOUNCED);
+          Kernel::OS.MessageQueue.PostDelayed(MSG_ID_KEY_DEBOUNCED, this->DEBOUNCE_MS);
           this->last_pressed = registered_key;
           this->key_state = KEY_PRESS_DETECTED;
           break;
@@ -54,13 +65,13 @@ void KeypadTask::TaskLoop(void)
       }
     case KEY_PRESS_DETECTED:
       {
-        if (this->key_timer.isExpired() && (registered_key & this->last_pressed & 0b01111000))
+        if (this->debounced && (registered_key & this->last_pressed & 0b01111000))
         {
           for (const auto& it : this->KEY_MAP)
             if (it[0] == registered_key)
             {
-              Kernel::OS.MessageQueue.Post(MSG_ID_UPDATE_7SEG, (void*)it[1], Kernel::MQ_OWNER_CALLER, Kernel::MQ_CONTEXT_TASK);
-              Kernel::OS.MessageQueue.Post(MSG_ID_KEY_PRESSED, (void*)it[1], Kernel::MQ_OWNER_CALLER, Kernel::MQ_CONTEXT_TASK);
+              Kernel::OS.MessageQueue.Post<uint8_t>(MSG_ID_UPDATE_7SEG, it[1]);
+              Kernel::OS.MessageQueue.Post<uint8_t>(MSG_ID_KEY_PRESSED, it[1]);
               this->key_state = KEY_PRESSED;
             }
         }
@@ -76,9 +87,9 @@ void KeypadTask::TaskLoop(void)
 
         for (const auto& it : this->KEY_MAP)
           if (it[0] == registered_key)
-            Kernel::OS.MessageQueue.Post(MSG_ID_KEY_PRESSED, (void*)it[1], Kernel::MQ_OWNER_CALLER, Kernel::MQ_CONTEXT_TASK);
+            Kernel::OS.MessageQueue.Post<uint8_t>(MSG_ID_KEY_PRESSED, it[1]);
 
-        Kernel::OS.MessageQueue.Post(MSG_ID_UPDATE_7SEG, (void*)0b11111111, Kernel::MQ_OWNER_CALLER, Kernel::MQ_CONTEXT_TASK);
+        Kernel::OS.MessageQueue.Post<uint8_t>(MSG_ID_UPDATE_7SEG, 0b11111111);
         this->key_state = KEY_IDLE;
         break;
       }
@@ -90,3 +101,12 @@ void KeypadTask::TaskLoop(void)
   }
 
 }
+
+
+void KeypadTask::EventHandler(int _posted_msg_id, void * _context)
+{
+  // a message already posted for an earlier press can still arrive after
+  // CancelTimers, so only accept one that is due for this press
+  if ((_posted_msg_id == MSG_ID_KEY_DEBOUNCED) && (Kernel::TimerService::Now() - this->press_start_us >= this->DEBOUNCE_MS * 1000UL))
+    this->debounced = true;
+}
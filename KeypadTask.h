@@ -11,10 +11,23 @@
 class KeypadTask : public Kernel::Task
 {
     static constexpr unsigned char KEYPAD_DEFAULT_IIC_ADDRESS = 64;
+
+    // MCP23017: 1.7 MHz (the kernel caps it at what the TWI supports)
+    static constexpr unsigned long KEYPAD_MAX_IIC_HZ = 1700000;
     
+    static constexpr unsigned long DEBOUNCE_MS = 20;
+    static constexpr unsigned long KEYPAD_POLL_MS = 5;
+
+    // task priority (lower is more urgent, see Task.h): below control,
+    // above the display
+    static constexpr uint8_t TASK_PRIO = 1;
+
     unsigned char last_pressed = 0; 
     
-    Kernel::OSTimer	key_timer = 10; 
+    bool debounced = false;
+
+    // when the current press was first seen
+    unsigned long press_start_us = 0;
 
     // map 8-bit GPIO port address, to the key value ->
     const unsigned char KEY_MAP[12][2] =
@@ -50,6 +63,12 @@ class KeypadTask : public Kernel::Task
     /// of the keyboard between presses
     virtual void TaskLoop(void);
 
+    /// Receives MSG_ID_KEY_DEBOUNCED once the debounce delay has passed
+    virtual void EventHandler(int _posted_msg_id, void * _context);
+
+    // compile-time routes (routes.cpp) call EventHandler directly
+    template<class T> friend void Kernel::MQRouteToReceiver(T & receiver, int msgid, void * context);
+
   public:
     /// This is the constructor: simply registers this task with the
     /// kernel and starts it - it can run from the get-go.
@@ -3,9 +3,13 @@
 
 LogTask::LogTask() : log_system_state(LOG_SYSTEM_STATE::INIT)
 {
-  Kernel::OS.MessageQueue.Subscribe(MSG_ID_DATALOG_LOGEVENT, this);
-  Kernel::OS.MessageQueue.Subscribe(MSG_ID_DATALOG_DUMPLOG, this);
-  Kernel::OS.MessageQueue.Subscribe(MSG_ID_DATALOG_DELETELOG, this);
+  this->WakeOnMessage(MSG_ID_DATALOG_LOGEVENT);
+  this->WakeOnMessage(MSG_ID_DATALOG_DUMPLOG);
+  this->WakeOnMessage(MSG_ID_DATALOG_DELETELOG);
+  this->WakeOnMessage(MSG_ID_E2_DONE);
+
+  // run INIT straight away
+  this->Signal();
 }
 
 
@@ -21,11 +25,23 @@ void LogTask::TaskLoop()
   if (this->IIC_failures > 5)
     this->log_system_state = LOG_SYSTEM_STATE::IIC_FAIL;
 
+  // keep running while there is E2 work in hand (including retries after a
+  // failure), except while a transfer is on the bus: MSG_ID_E2_DONE wakes the
+  // task for that. READY_RW waits for a message, and IIC_FAIL suspends the task
+  if (this->log_system_state != LOG_SYSTEM_STATE::READY_RW && this->log_system_state != LOG_SYSTEM_STATE::IIC_FAIL
+      && !this->e2_busy)
+    this->Signal();
+
+  int rc;
+
   switch (this->log_system_state)
   {
     case LOG_SYSTEM_STATE::INIT:
       {
-        if (e2.memory_read(E2Driver::E2_LAST_ADDRESS, (uint8_t*)&this->control_block, sizeof(CONTROL_BLOCK)))
+        rc = this->E2Transfer(false, E2Driver::E2_LAST_ADDRESS, (uint8_t*)&this->control_block, sizeof(CONTROL_BLOCK));
+        if (rc == IIC_PENDING)
+          return;
+        if (rc)
         {
           ++this->IIC_failures;
           return;
@@ -59,12 +75,18 @@ void LogTask::TaskLoop()
         else if (this->pHead && this->message_queue_size)
           this->log_system_state = LOG_SYSTEM_STATE::WRITE_LOG_MSG;
 
+        if (this->log_system_state != LOG_SYSTEM_STATE::READY_RW)
+          this->Signal();
+
       }
       break;
 
     case LOG_SYSTEM_STATE::WRITE_LOG_MSG:
       {
-        if (this->e2.memory_write(this->control_block.next_free_entry, (const uint8_t*)this->pHead, MAX_LOG_MESSAGE_SIZE))
+        rc = this->E2Transfer(true, this->control_block.next_free_entry, (uint8_t*)this->pHead, MAX_LOG_MESSAGE_SIZE);
+        if (rc == IIC_PENDING)
+          return;
+        if (rc)
         {
           ++this->IIC_failures;
           return;
@@ -95,7 +117,10 @@ void LogTask::TaskLoop()
       }
     case LOG_SYSTEM_STATE::WRITE_CTRL_BLOCK:
       {
-        if (e2.memory_write(E2Driver::E2_LAST_ADDRESS, (const uint8_t*)&this->control_block, sizeof(CONTROL_BLOCK)))
+        rc = this->E2Transfer(true, E2Driver::E2_LAST_ADDRESS, (uint8_t*)&this->control_block, sizeof(CONTROL_BLOCK));
+        if (rc == IIC_PENDING)
+          return;
+        if (rc)
         {
           ++this->IIC_failures;
           return;
@@ -108,15 +133,16 @@ void LogTask::TaskLoop()
 
     case LOG_SYSTEM_STATE::READBACK_LOG:
       {
-        LOG_PAGE output_page;
-
-        if (this->e2.memory_read(this->next_to_read, (unsigned char*)&output_page, E2Driver::E2_PAGE_SIZE))
+        rc = this->E2Transfer(false, this->next_to_read, (uint8_t*)&this->readback_page, E2Driver::E2_PAGE_SIZE);
+        if (rc == IIC_PENDING)
+          return;
+        if (rc)
         {
           ++this->IIC_failures;
           return;
         }
 
-        this->LogPageToSerial(&output_page);
+        this->LogPageToSerial(&this->readback_page);
 
         if (++this->next_to_read == this->control_block.next_free_entry)
           this->log_system_state = LOG_SYSTEM_STATE::READY_RW;
@@ -127,6 +153,8 @@ void LogTask::TaskLoop()
       break;
 
     case LOG_SYSTEM_STATE::IIC_FAIL:
+      // terminal: take the logger out of the scheduler altogether
+      this->Suspend();
       break;
 
     default: break;
@@ -134,12 +162,41 @@ void LogTask::TaskLoop()
 }
 
 
-int LogTask::CreateLogEntry(const char* _message)
+// Start an E2 transfer, or pick up the one already on the bus. Returns
+// IIC_PENDING until it is done, then its status; meanwhile TaskLoop stays in
+// the same state and calls it again with the same arguments.
+int LogTask::E2Transfer(bool _write, uint16_t _page_address, uint8_t* _data, uint8_t _data_length)
+{
+  if (!this->e2_busy)
+  {
+    int rc = _write ? this->e2.memory_write_async(_page_address, _data, _data_length, MSG_ID_E2_DONE)
+                    : this->e2.memory_read_async(_page_address, _data, _data_length, MSG_ID_E2_DONE);
+    if (rc)
+      return rc;
+
+    this->e2_busy = true;
+    return IIC_PENDING;
+  }
+
+  int status = this->e2.transfer_status();
+  if (status != IIC_PENDING)
+  {
+    // the top of TaskLoop skipped its Signal on this pass: carry on from here
+    this->e2_busy = false;
+    this->Signal();
+  }
+
+  return status;
+}
+
+
+int LogTask::CreateLogEntry(const DATALOG_EVENT& _event)
 {
   RTC_DATE date;
   LOG_PAGE* new_page_entry = new LOG_PAGE;
 
-  if ( (strlcpy(new_page_entry->message, _message, MAX_LOG_MESSAGE_SIZE) >= MAX_LOG_MESSAGE_SIZE)
+  if ( (snprintf(new_page_entry->message, MAX_LOG_MESSAGE_SIZE, "- Demand RPS: %03d\n- Actual RPS: %03d\n",
+                 _event.demand_rps, _event.actual_rps) >= MAX_LOG_MESSAGE_SIZE)
        || (this->message_queue_size >= this->MAX_MESSAGE_QUEUE_SIZE)
        || this->rtc.get_date(new_page_entry->date)
        || !new_page_entry)
@@ -186,7 +243,7 @@ void LogTask::EventHandler(int _message_id, void * _context)
   switch (_message_id)
   {
     case MSG_ID_DATALOG_LOGEVENT:
-      CreateLogEntry((const char*)_context);
+      CreateLogEntry(Kernel::MQPayload<DATALOG_EVENT>(_context));
       break;
 
     case MSG_ID_DATALOG_DUMPLOG:
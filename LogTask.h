@@ -51,13 +51,21 @@ class LogTask : public Kernel::Task, public RTCDriver, public E2Driver
 
     bool start_readback, start_delete = false;
 
-    int CreateLogEntry(const char* _message);
+    // an E2 transfer is on the bus; the task sleeps until MSG_ID_E2_DONE
+    bool e2_busy = false;
+    LOG_PAGE readback_page;
+
+    int E2Transfer(bool _write, uint16_t _page_address, uint8_t* _data, uint8_t _data_length);
+    int CreateLogEntry(const DATALOG_EVENT& _event);
     void LogPageToSerial(LOG_PAGE* _page);
 
   protected:
     virtual void TaskLoop();
     virtual void EventHandler(int _message_id, void * _context);
 
+    // compile-time routes (routes.cpp) call EventHandler directly
+    template<class T> friend void Kernel::MQRouteToReceiver(T & receiver, int msgid, void * context);
+
   public:
     LogTask();
 
@@ -6,6 +6,8 @@ RTCDriver::RTCDriver(unsigned char _iic_address) : RTC_ICC_ADDRESS(_iic_address)
   // set ST bit to 1 (0x80)
   unsigned char iicregs[2] = {0x00, 0x80};
 
+  Kernel::IIC::Get().SetDeviceSpeed(this->RTC_ICC_ADDRESS, RTC_MAX_IIC_HZ);
+
   // write the address
   Kernel::OS.IICDriver.IICWrite(this->RTC_ICC_ADDRESS, iicregs, 2);
 }
@@ -13,7 +15,8 @@ RTCDriver::RTCDriver(unsigned char _iic_address) : RTC_ICC_ADDRESS(_iic_address)
 
 int RTCDriver::set_date(RTC_DATE& _input_date)
 {
-  RTC_LOG load;
+  RTC_DATE load;
+  unsigned char iicreg = 0;
 
   int max_month_days[12] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
 
@@ -37,33 +40,29 @@ int RTCDriver::set_date(RTC_DATE& _input_date)
   if (_input_date.second < 0 || _input_date.second > 59)
     return -1;
 
-  load.address = 0;
-  load.date.second =  ((_input_date.second % 10) | ((_input_date.second / 10) << 4)) | 0x80;
-  load.date.minute =  ((_input_date.minute % 10) | ((_input_date.minute / 10) << 4)) | 0x80;
-  load.date.hour =    ((_input_date.hour % 10) | ((_input_date.hour / 10) << 4)) | 0x00; // 24hr format
+  load.second = ((_input_date.second % 10) | ((_input_date.second / 10) << 4)) | 0x80;
+  load.minute = ((_input_date.minute % 10) | ((_input_date.minute / 10) << 4)) | 0x80;
+  load.hour =   ((_input_date.hour % 10) | ((_input_date.hour / 10) << 4)) | 0x00; // 24hr format
+
+  load.date =   ((_input_date.date % 10) | ((_input_date.date / 10) << 4)) | 0x00;
+  load.month =  ((_input_date.month % 10) | ((_input_date.month / 10) << 4)) | 0x00;
+  load.year =   ((_input_date.year % 10) | ((_input_date.year / 10) << 4));
 
-  load.date.date =    ((_input_date.date % 10) | ((_input_date.date / 10) << 4)) | 0x00;
-  load.date.month =   ((_input_date.month % 10) | ((_input_date.month / 10) << 4)) | 0x00;
-  load.date.year =    ((_input_date.year % 10) | ((_input_date.year / 10) << 4));
+  // Writing the register address and the date data to the RTC
+  Kernel::IICSEG segs[2] = {{&iicreg, 1}, {&load, sizeof(RTC_DATE)}};
 
-  // Writing the date data to the RTC
-  return Kernel::OS.IICDriver.IICWrite(this->RTC_ICC_ADDRESS, (unsigned char *)&load, sizeof(RTC_LOG));
+  return Kernel::OS.IICDriver.WriteV(this->RTC_ICC_ADDRESS, segs, 2);
 }
 
 
 int RTCDriver::get_date(RTC_DATE& _input_date)
 {
   RTC_DATE load;
-  unsigned char iicregs[2] = {0, 0};
-
-  // write the address ->
-  // return error (-1) if unsuccessful
-  if (Kernel::OS.IICDriver.IICWrite(this->RTC_ICC_ADDRESS, iicregs, 1))
-    return -1;
+  unsigned char iicreg = 0;
 
-  // read the values ->
+  // write the address, then read the values back after a repeated START ->
   // return error (-1) if unsuccessful
-  if (Kernel::OS.IICDriver.IICRead(this->RTC_ICC_ADDRESS, (unsigned char *)&load, sizeof(RTC_DATE)))
+  if (Kernel::OS.IICDriver.WriteRead(this->RTC_ICC_ADDRESS, &iicreg, 1, (unsigned char *)&load, sizeof(RTC_DATE)))
     return -1;
 
   // update input date ->
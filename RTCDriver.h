@@ -13,6 +13,9 @@
 class RTCDriver {
     static constexpr unsigned char RTC_DEFAULT_IIC_ADDRESS = 222;
 
+    // MCP7940: 400 kHz
+    static constexpr unsigned long RTC_MAX_IIC_HZ = 400000;
+
   protected:
     const unsigned char RTC_ICC_ADDRESS;
     
@@ -27,12 +30,6 @@ class RTCDriver {
       uint8_t year;
     };
 
-    struct RTC_LOG
-    {
-      uint8_t address;
-      RTC_DATE date;
-    };
-
   public:
     // custom constructor : takes RTC address ->
     // enables multiple Real-Time-Clock devices instantiation
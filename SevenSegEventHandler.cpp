@@ -13,16 +13,16 @@ SevenSegEventHandler::SevenSegEventHandler()
   PORTB &= ~0b00000001;   // data pin low
   PORTD &= ~0b00010000;   // clock pin low
 
-  Kernel::OS.MessageQueue.Subscribe(MSG_ID_UPDATE_7SEG, this);
-  Kernel::OS.MessageQueue.Post(MSG_ID_UPDATE_7SEG, (void *)0b11111111, Kernel::MQ_OWNER_CALLER, Kernel::MQ_CONTEXT_TASK);
+  Kernel::OS.MessageQueue.Post<uint8_t>(MSG_ID_UPDATE_7SEG, 0b11111111);
 }
 
 
 void SevenSegEventHandler::EventHandler(int _posted_msg_id, void * _context)
 {
-  unsigned char to_decimal = this->segment[min((uint16_t)_context % 16, 12)];
+  uint8_t key = Kernel::MQPayload<uint8_t>(_context);
+  unsigned char to_decimal = this->segment[min(key % 16, 12)];
 
-  if ((uint16_t)_context & this->msb_mask)
+  if (key & this->msb_mask)
     to_decimal &= ~this->lsb_mask;
 
   for (auto i = 0; i < 8; ++i)
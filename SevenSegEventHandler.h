@@ -35,6 +35,9 @@ class SevenSegEventHandler : public Kernel::EventReceiver
   protected:
     virtual void EventHandler(int _posted_msg_id, void * _context);
 
+    // compile-time routes (routes.cpp) call EventHandler directly
+    template<class T> friend void Kernel::MQRouteToReceiver(T & receiver, int msgid, void * context);
+
   public:
     SevenSegEventHandler();
 
@@ -2,27 +2,29 @@
 
 Control::Control()
 {
-  Kernel::OS.MessageQueue.Subscribe(MSG_ID_NEW_RPS_ENTERED, this);
 }
 
 void Control::TaskLoop()
 {
-  if (!this->timer.isExpired())
-    return;
+  if (this->WokenBy() & TASK_EVENT_TIMER)
+    this->Tick();
+}
+
+void Control::Tick()
+{
+  this->Heartbeat();
 
   if (this->demand_rps != 0)
     this->timer_counter++;
 
   this->actual_rps = RPS::GetRPS();
-  Kernel::OS.MessageQueue.Post(MSG_ID_NEW_ACTUAL_RPS, (void *)this->actual_rps, Kernel::MQ_OWNER_CALLER, Kernel::MQ_CONTEXT_TASK);
+  Kernel::OS.MessageQueue.Post<uint16_t>(MSG_ID_NEW_ACTUAL_RPS, this->actual_rps);
 
   if (this->timer_counter >= 8 && this->demand_rps > 0)
   {
     this->SendLogMessage(this->demand_rps, this->actual_rps);
     timer_counter = 0;
   }
-
-  this->timer.Restart();
 }
 
 void Control::EventHandler(int _posted_msg_id, void *_context)
@@ -30,28 +32,30 @@ void Control::EventHandler(int _posted_msg_id, void *_context)
   if (_posted_msg_id != MSG_ID_NEW_RPS_ENTERED)
     return;
 
-  if ((uint16_t)_context >= 330 || (uint16_t)_context == 0)
-    this->demand_rps = (uint16_t)_context;
-  else if ((uint16_t)_context >= 310)
-    this->demand_rps = (uint16_t)_context - 10;
-  else if ((uint16_t)_context >= 230)
-    this->demand_rps = (uint16_t)_context - 40;
-  else if ((uint16_t)_context >= 230)
-    this->demand_rps = (uint16_t)_context - 55;
-  else if ((uint16_t)_context >= 150)
-    this->demand_rps = (uint16_t)_context - 40;
-  else if ((uint16_t)_context >= 120)
-    this->demand_rps = (uint16_t)_context - 35;
-  else if ((uint16_t)_context >= 100)
-    this->demand_rps = (uint16_t)_context - 25;
-  else if ((uint16_t)_context >= 70)
-    this->demand_rps = (uint16_t)_context - 5;
-  else if ((uint16_t)_context >= 50)
-    this->demand_rps = (uint16_t)_context + 5;
+  uint16_t entered_rps = Kernel::MQPayload<uint16_t>(_context);
+
+  if (entered_rps >= 330 || entered_rps == 0)
+    this->demand_rps = entered_rps;
+  else if (entered_rps >= 310)
+    this->demand_rps = entered_rps - 10;
+  else if (entered_rps >= 230)
+    this->demand_rps = entered_rps - 40;
+  else if (entered_rps >= 230)
+    this->demand_rps = entered_rps - 55;
+  else if (entered_rps >= 150)
+    this->demand_rps = entered_rps - 40;
+  else if (entered_rps >= 120)
+    this->demand_rps = entered_rps - 35;
+  else if (entered_rps >= 100)
+    this->demand_rps = entered_rps - 25;
+  else if (entered_rps >= 70)
+    this->demand_rps = entered_rps - 5;
+  else if (entered_rps >= 50)
+    this->demand_rps = entered_rps + 5;
 
   PWM::SetPWM(this->demand_rps * 255 / this->RPS_MAX);
 
-  this->demand_rps = (uint16_t)_context;
+  this->demand_rps = entered_rps;
 
   if (this->demand_rps == 0)
     Kernel::OS.MessageQueue.Post(MSG_ID_DATALOG_DUMPLOG, NULL, Kernel::MQ_OWNER_CALLER, Kernel::MQ_CONTEXT_TASK);
@@ -61,10 +65,8 @@ void Control::EventHandler(int _posted_msg_id, void *_context)
 
 void Control::SendLogMessage(uint16_t _demand_rps, uint16_t _actual_rps)
 {
-  // Using a static array for log_message to avoid dynamic memory allocation and promote modularity.
-  // This approach ensures predictable memory usage, and the relatively small log_message size
-  // keeps the overhead low.
-  static char log_message[38];
-  sprintf(log_message, "- Demand RPS: %03d\n- Actual RPS: %03d\n", _demand_rps, _actual_rps);
-  Kernel::OS.MessageQueue.Post(MSG_ID_DATALOG_LOGEVENT, log_message, Kernel::MQ_OWNER_CALLER, Kernel::MQ_CONTEXT_TASK);
+  // The values are copied into the message itself and formatted by the logger, so a
+  // second log event posted before the first is handled can't overwrite it.
+  DATALOG_EVENT log_event = {_demand_rps, _actual_rps};
+  Kernel::OS.MessageQueue.Post<DATALOG_EVENT>(MSG_ID_DATALOG_LOGEVENT, log_event);
 }
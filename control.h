@@ -9,10 +9,11 @@
 #include "pwm.h"
 
 class Control : public Kernel::Task {
-    Kernel::OSTimer	timer = 250;
-
     unsigned long timer_counter, demand_rps, actual_rps = 0;
 
+    // runs on each periodic release (every CONTROL_TICK_MS)
+    void Tick();
+
     void SendLogMessage(uint16_t _demand_rps, uint16_t _actual_rps);
 
   protected:
@@ -22,9 +23,16 @@ class Control : public Kernel::Task {
     // case, this is the mapping we want displayed
     virtual void EventHandler(int _posted_msg_id, void * _context);
 
+    // compile-time routes (routes.cpp) call EventHandler directly
+    template<class T> friend void Kernel::MQRouteToReceiver(T & receiver, int msgid, void * context);
+
   public:
     static constexpr uint16_t RPS_MAX = 340;
     static constexpr uint8_t RPS_MIN = 50;
+    static constexpr unsigned long CONTROL_TICK_MS = 250;
+
+    // task priority (lower is more urgent, see Task.h)
+    static constexpr uint8_t TASK_PRIO = 0;
 
     Control();
 
@@ -1,11 +1,25 @@
 #include "display.h"
 
 
-Display::Display() : lcd(this->DISPLAY_DEFAULT_IIC_ADDRESS, 16, 2), display_state(INIT_DISPLAY)
+Display::Display() : lcd(this->DISPLAY_DEFAULT_IIC_ADDRESS, 16, 2)
 {
-  Kernel::OS.MessageQueue.Subscribe(MSG_ID_INIT_COMPLETE, this);
-  Kernel::OS.MessageQueue.Subscribe(MSG_ID_NEW_ACTUAL_RPS, this);
-  Kernel::OS.MessageQueue.Subscribe(MSG_ID_KEY_PRESSED, this);
+  // the coroutine only waits on these (and on its own timer and yields)
+  this->WakeOnMessage(MSG_ID_INIT_COMPLETE);
+  this->WakeOnMessage(MSG_ID_NEW_ACTUAL_RPS);
+  this->WakeOnMessage(MSG_ID_KEY_PRESSED);
+
+  // run once at start to show the splash screen
+  this->Signal();
+}
+
+
+void Display::PrintActualRps()
+{
+  char print_value[16];
+
+  this->lcd.setCursor(0, 1);
+  sprintf(print_value, "ACTUAL RPS: %03d", this->actual_rps);
+  this->lcd.print(print_value);
 }
 
 
@@ -13,81 +27,71 @@ void Display::TaskLoop(void)
 {
   char print_value[16];
 
-  switch (this->display_state)
-  {
-    case INIT_DISPLAY:
-      this->lcd.init();
-      this->lcd.backlight();
-      this->lcd.clear();
-      this->lcd.setCursor(0, 0);
-      this->lcd.print("Starting...");
+  // the LCD library drives the TWI itself through Wire, so let any queued
+  // kernel IIC transfers finish first
+  Kernel::OS.IICDriver.Flush();
 
-      if (this->init_complete)
-        this->display_state = REFRESH_DISPLAY;
+  // each LCD row is a burst of blocking I2C traffic, so the coroutine yields
+  // between rows rather than holding the CPU for a whole screen
+  CO_BEGIN(this->co);
 
-      break;
+  this->lcd.init();
+  this->lcd.backlight();
+  this->lcd.clear();
+  this->lcd.setCursor(0, 0);
+  this->lcd.print("Starting...");
 
-    case REFRESH_DISPLAY:
-      this->lcd.clear();
+  CO_WAIT_UNTIL(this->co, this->init_complete);
 
-      this->lcd.setCursor(0, 0);
-      sprintf(print_value, "DEMAND RPS: %03d", this->demand_rps);
-      this->lcd.print(print_value);
+  for (;;)
+  {
+    // refresh the whole display
+    this->lcd.clear();
+    this->lcd.setCursor(0, 0);
+    sprintf(print_value, "DEMAND RPS: %03d", this->demand_rps);
+    this->lcd.print(print_value);
 
-      this->lcd.setCursor(0, 1);
-      sprintf(print_value, "ACTUAL RPS: %03d", this->actual_rps);
-      this->lcd.print(print_value);
+    CO_YIELD(this->co);
 
-      this->display_state = IDLE_DISPLAY;
+    this->current_rps = this->actual_rps;
+    this->PrintActualRps();
 
-      break;
+    // idle: follow the actual rps until a digit starts an entry. Backspace and
+    // enter (* 10>) are ignored here
+    for (;;)
+    {
+      CO_WAIT_UNTIL(this->co, this->is_key_pressed || this->actual_rps != this->current_rps);
 
-    case IDLE_DISPLAY:
-      // ignore backspace & enter keys (* 10>)
-      if (this->is_key_pressed && this->current_key < 0b00001010)
+      if (this->is_key_pressed)
       {
         this->is_key_pressed = false;
-        this->display_state = this->FIRST_KEY_PRESS;
+        if (this->current_key < 0b00001010)
+          break;
       }
-
-      else if (this->actual_rps != this->current_rps)
+      else
       {
         this->current_rps = this->actual_rps;
-        this->display_state = NEW_ACTUAL_RPS;
+        this->PrintActualRps();
       }
+    }
 
-      break;
-
-    case NEW_ACTUAL_RPS:
-      this->lcd.setCursor(0, 1);
-      sprintf(print_value, "ACTUAL RPS: %03d", this->actual_rps);
-      this->lcd.print(print_value);
-
-      this->display_state = IDLE_DISPLAY;
-
-      break;
-
-    case FIRST_KEY_PRESS:
-      this->cursor_position = 9;
-
-      this->lcd.clear();
-      this->lcd.setCursor(0, 0);
-      this->lcd.print("New RPS: 000");
+    // first key of an entry
+    this->cursor_position = 9;
 
-      sprintf(this->user_input_values, "%03d", this->demand_rps);
-      memset(this->user_input_values, 0, sizeof(this->user_input_values));
-      this->user_input_values[0] = this->current_key + 0b00110000; //int to ascii (adding 0b00110000)
-      this->lcd.setCursor(this->cursor_position++, 0);
-      this->lcd.blink();
-      this->lcd.print(this->user_input_values);
+    this->lcd.clear();
+    this->lcd.setCursor(0, 0);
+    this->lcd.print("New RPS: 000");
 
-      this->display_state = NEXT_KEY_PRESS;
-
-      break;
+    memset(this->user_input_values, 0, sizeof(this->user_input_values));
+    this->user_input_values[0] = this->current_key + 0b00110000; //int to ascii (adding 0b00110000)
+    this->lcd.setCursor(this->cursor_position++, 0);
+    this->lcd.blink();
+    this->lcd.print(this->user_input_values);
 
-    case NEXT_KEY_PRESS:
-      if (!this->is_key_pressed)
-        break;
+    // further keys until enter
+    for (;;)
+    {
+      CO_WAIT_UNTIL(this->co, this->is_key_pressed);
 
       this->is_key_pressed = false;
 
@@ -100,14 +104,7 @@ void Display::TaskLoop(void)
       }
 
       else if (this->current_key == 0b00001011) //enter
-      {
-        this->lcd.noCursor();
-        this->lcd.noBlink();
-        for (auto& it : this->user_input_values)
-          if (it == 0) it = '0';
-        sscanf(this->user_input_values, "%d", &this->input_rps);
-        this->display_state = VALIDATE_INPUT;
-      }
+        break;
 
       else if ((this->cursor_position < 12) && (this->current_key < 10)) //enter next  num
       {
@@ -115,44 +112,37 @@ void Display::TaskLoop(void)
         this->lcd.setCursor(9, 0);
         this->lcd.print(this->user_input_values);
       }
-
-      break;
-
-    case VALIDATE_INPUT:
-      if (this->input_rps == 0 || (this->input_rps >= Control::RPS_MIN && this->input_rps <= Control::RPS_MAX))
-      {
-        this->demand_rps = this->input_rps;
-        Kernel::OS.MessageQueue.Post(MSG_ID_NEW_RPS_ENTERED, (void*)this->input_rps, Kernel::MQ_OWNER_CALLER, Kernel::MQ_CONTEXT_TASK);
-        this->display_state = REFRESH_DISPLAY;
-        break;
-      }
-
-      this->error_timer.Set(2000);
-      this->lcd.clear();
-      this->lcd.setCursor(0, 0);
-      this->lcd.print("ERROR:");
-      this->lcd.setCursor(0, 1);
-      this->lcd.print("INVALID INPUT!");
-
-      this->display_state = DISPLAY_ERROR;
-      break;
-
-    case DISPLAY_ERROR:
-      if (! error_timer.isExpired())
-        break;
-
-      this->lcd.setCursor(9, 0);
-      this->lcd.print(user_input_values);
-      this->lcd.setCursor(9, 0);
-      this->lcd.noBlink();
-
-      this->display_state = REFRESH_DISPLAY;
-      break;
-
-    default:
-      this->display_state = IDLE_DISPLAY;
-      break;
+    }
+
+    // validate the input
+    this->lcd.noCursor();
+    this->lcd.noBlink();
+    for (auto& it : this->user_input_values)
+      if (it == 0) it = '0';
+    sscanf(this->user_input_values, "%d", &this->input_rps);
+
+    if (this->input_rps == 0 || (this->input_rps >= Control::RPS_MIN && this->input_rps <= Control::RPS_MAX))
+    {
+      this->demand_rps = this->input_rps;
+      Kernel::OS.MessageQueue.Post<uint16_t>(MSG_ID_NEW_RPS_ENTERED, this->input_rps);
+      continue;
+    }
+
+    this->lcd.clear();
+    this->lcd.setCursor(0, 0);
+    this->lcd.print("ERROR:");
+    this->lcd.setCursor(0, 1);
+    this->lcd.print("INVALID INPUT!");
+
+    CO_AWAIT_TIMER(this->co, this->ERROR_DISPLAY_MS);
+
+    this->lcd.setCursor(9, 0);
+    this->lcd.print(user_input_values);
+    this->lcd.setCursor(9, 0);
+    this->lcd.noBlink();
   }
+
+  CO_END(this->co);
 }
 
 
@@ -165,12 +155,12 @@ void Display::EventHandler(int _posted_msg_id, void * _context)
       break;
 
     case MSG_ID_NEW_ACTUAL_RPS:
-      this->actual_rps = (uint16_t)_context;
+      this->actual_rps = Kernel::MQPayload<uint16_t>(_context);
       break;
 
     case MSG_ID_KEY_PRESSED:
       this->is_key_pressed = true;
-      this->current_key = (uint16_t)_context;
+      this->current_key = Kernel::MQPayload<uint8_t>(_context);
       break;
 
     default: break;
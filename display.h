@@ -28,27 +28,20 @@ class Display : public Kernel::Task
     
     char user_input_values[3];
 
-    Kernel::OSTimer error_timer;
+    static constexpr unsigned long ERROR_DISPLAY_MS = 2000;
 
     LiquidCrystal_I2C lcd;
 
-    enum DISPLAY_STATE
-    {
-      INIT_DISPLAY,
-      REFRESH_DISPLAY,
-      IDLE_DISPLAY,
-      NEW_ACTUAL_RPS,
-      NEW_DEMAND_RPS,
-      FIRST_KEY_PRESS,
-      NEXT_KEY_PRESS,
-      VALIDATE_INPUT,
-      DISPLAY_ERROR
-    } display_state;
+    // where the display coroutine is suspended (see kernel/coroutine.h)
+    Kernel::COSTATE co = 0;
+
+    void PrintActualRps();
 
 
   protected:
     /// This is the task loop function, called repeatedly. This implements
-    /// the display FSM
+    /// the display as a coroutine, so it can give up the CPU between LCD
+    /// updates
     virtual void TaskLoop(void);
 
     /// This will be called by the message queue, once the class instance
@@ -58,8 +51,14 @@ class Display : public Kernel::Task
     /// by any other mechanism
     virtual void EventHandler(int _posted_msg_id, void * _context);
 
+    // compile-time routes (routes.cpp) call EventHandler directly
+    template<class T> friend void Kernel::MQRouteToReceiver(T & receiver, int msgid, void * context);
+
 
   public:   
+    // task priority (lower is more urgent, see Task.h)
+    static constexpr uint8_t TASK_PRIO = 2;
+
     Display();
 };
 
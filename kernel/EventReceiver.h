@@ -9,9 +9,12 @@
 
 namespace Kernel {
 
+	template<class T> void MQRouteToReceiver(T & receiver, int msgid, void * context);	// see mqroute.h
+
 	class EventReceiver {
 
 		friend class MHCLASS; // the internal class used by the MQ needs to access the protected EventHandler member function
+		template<class T> friend void MQRouteToReceiver(T & receiver, int msgid, void * context); // as do compile-time routes
 
 		public:
 
@@ -8,6 +8,7 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include "KernelClass.h"
+#include <avr/sleep.h>
 
 namespace Kernel {
 
@@ -20,8 +21,20 @@ namespace Kernel {
 ///
 ///////////////////////////////////////////////////////////////////////////////
 
-KernelClass::KernelClass()
+KernelClass::KernelClass() : SchedPolicy(KSCHED_FIXED), SchedParam(2)
 {
+	memset(&SchedStats,0,sizeof(SchedStats));
+	#if KERNEL_IDLE_SLEEP
+	ResetIdleStats();
+	#endif
+	#if TASK_WATCHDOG
+	WatchdogOut=NULL;
+	#endif
+	#if TASK_PROFILE
+	ProfileOut=NULL;
+	ProfilePeriod=0;
+	ProfileLast=0;
+	#endif
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -39,4 +52,310 @@ KernelClass::~KernelClass()
 	// normally never called in an embedded environment
 }
 
+///////////////////////////////////////////////////////////////////////////////
+/// SetSchedPolicy
+///
+/// Select the message scheduling policy used by each pass of loop().
+///
+/// @scope: PUBLIC
+/// @context: TASK
+/// @param: KSCHEDPOLICY policy
+/// @param: unsigned int param - message count for KSCHED_FIXED, budget
+///         (maximum budget for KSCHED_ADAPTIVE) in microseconds otherwise
+/// @return: none
+///
+///////////////////////////////////////////////////////////////////////////////
+
+void KernelClass::SetSchedPolicy(KSCHEDPOLICY policy, unsigned int param)
+{
+	SchedPolicy=policy;
+	SchedParam=param;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// GetSchedStats
+///
+/// Obtain a copy of the scheduler statistics.
+///
+/// @scope: PUBLIC
+/// @context: TASK
+/// @param: KSCHEDSTATS * stats - receives the statistics
+/// @return: none
+///
+///////////////////////////////////////////////////////////////////////////////
+
+void KernelClass::GetSchedStats(KSCHEDSTATS * stats)
+{
+	if(stats) {
+		*stats=SchedStats;
+	}
+}
+
+#if TASK_PROFILE
+
+///////////////////////////////////////////////////////////////////////////////
+/// SetProfileDump
+///
+/// Print the task profile every period milliseconds.
+///
+/// @scope: PUBLIC
+/// @context: TASK
+/// @param: Print * out - where to print (e.g. &Serial)
+/// @param: unsigned long period - in milliseconds
+/// @return: none
+///
+///////////////////////////////////////////////////////////////////////////////
+
+void KernelClass::SetProfileDump(Print * out, unsigned long period)
+{
+	ProfileOut=period?out:NULL;
+	ProfilePeriod=period;
+	ProfileLast=millis();
+}
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+/// Housekeeping
+///
+/// Periodic kernel services run once per pass of loop().
+///
+/// @scope: PRIVATE
+/// @context: TASK
+/// @param: none
+/// @return: none
+///
+///////////////////////////////////////////////////////////////////////////////
+
+void KernelClass::Housekeeping(void)
+{
+	#if TASK_WATCHDOG
+	WatchdogService();
+	#endif
+	#if TASK_PROFILE
+	if(ProfileOut && ((millis()-ProfileLast)>=ProfilePeriod)) {
+		ProfileLast+=ProfilePeriod;
+		TaskManager.DumpProfile(*ProfileOut);
+		#if IIC_STATS
+		IICDriver.DumpStats(*ProfileOut);
+		#endif
+		#if KERNEL_IDLE_SLEEP
+		KIDLESTATS idle;
+		GetIdleStats(&idle);
+		ProfileOut->print(F("IDLE,"));
+		ProfileOut->print((unsigned int)idle.IdlePercent);
+		ProfileOut->print(',');
+		ProfileOut->print(idle.Sleeps);
+		ProfileOut->print(',');
+		ProfileOut->print(idle.Wakes);
+		ProfileOut->print(',');
+		ProfileOut->print(idle.LatencyWorst);
+		ProfileOut->print(',');
+		ProfileOut->println(idle.LatencyMean);
+		ResetIdleStats();
+		#endif
+	}
+	#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// PowerInit
+///
+/// Power down the peripherals in KERNEL_PRR_GATE. The ADC must be switched off
+/// before its clock is stopped, or it stays powered; the analog comparator
+/// is not under PRR and is switched off with it.
+///
+/// @scope: PRIVATE
+/// @context: TASK
+/// @param: none
+/// @return: none
+///
+///////////////////////////////////////////////////////////////////////////////
+
+void KernelClass::PowerInit(void)
+{
+	if(KERNEL_PRR_GATE & _BV(PRADC)) {
+		ADCSRA&=~_BV(ADEN);
+		ACSR|=_BV(ACD);
+	}
+	PRR|=KERNEL_PRR_GATE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Idle
+///
+/// End of a pass of loop(): account for the wake that led to it, and if the
+/// pass did no work and none is pending, sleep until the next interrupt.
+///
+/// The check and the sleep are made with interrupts masked: sei() takes
+/// effect only after the following instruction, so an ISR that posts a
+/// message or signals a task after the check still wakes the sleep rather
+/// than being missed until the next tick.
+///
+/// @scope: PRIVATE
+/// @context: TASK
+/// @param: boolean busy - true if the pass dispatched a message or ran a task
+/// @return: none
+///
+///////////////////////////////////////////////////////////////////////////////
+
+void KernelClass::Idle(boolean busy)
+{
+	#if KERNEL_IDLE_SLEEP
+	unsigned long start;
+	unsigned long now;
+
+	if(WakePending) {
+		WakePending=false;
+		if(busy) {
+			unsigned long latency=PassStart-WakeTime;
+			IdleStats.Wakes++;
+			IdleLatencyTotal+=latency;
+			if(latency>IdleStats.LatencyWorst) {
+				IdleStats.LatencyWorst=latency;
+			}
+		}
+	}
+	if(busy) {
+		return;
+	}
+
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	cli();
+	if(MessageQueue.GetDepth() || TaskManager.AnyPending()) {
+		sei();
+		return;
+	}
+	start=TimerService::Now();
+	sleep_enable();
+	sei();
+	sleep_cpu();
+	sleep_disable();
+	now=TimerService::Now();
+
+	IdleStats.Sleeps++;
+	IdleStats.Asleep+=now-start;
+	WakeTime=now;
+	WakePending=true;
+	#endif
+}
+
+#if KERNEL_IDLE_SLEEP
+
+///////////////////////////////////////////////////////////////////////////////
+/// GetIdleStats
+///
+/// Obtain the idle statistics.
+///
+/// @scope: PUBLIC
+/// @context: TASK
+/// @param: KIDLESTATS * stats - receives the statistics
+/// @return: none
+///
+///////////////////////////////////////////////////////////////////////////////
+
+void KernelClass::GetIdleStats(KIDLESTATS * stats)
+{
+	if(stats) {
+		*stats=IdleStats;
+		stats->Window=TimerService::Now()-IdleWindowStart;
+		stats->IdlePercent=stats->Window?(uint8_t)(stats->Asleep/(stats->Window/100+1)):0;
+		stats->LatencyMean=IdleStats.Wakes?(IdleLatencyTotal/IdleStats.Wakes):0;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// ResetIdleStats
+///
+/// Zero the idle statistics and start a new window.
+///
+/// @scope: PUBLIC
+/// @context: TASK
+/// @param: none
+/// @return: none
+///
+///////////////////////////////////////////////////////////////////////////////
+
+void KernelClass::ResetIdleStats(void)
+{
+	memset(&IdleStats,0,sizeof(IdleStats));
+	IdleLatencyTotal=0;
+	IdleWindowStart=TimerService::Now();
+	WakePending=false;
+}
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+/// DispatchMessages
+///
+/// Run one message dispatch pass according to the scheduling policy, and
+/// account for it in the statistics.
+///
+/// @scope: PRIVATE
+/// @context: TASK
+/// @param: none
+/// @return: int - number of messages dispatched
+///
+///////////////////////////////////////////////////////////////////////////////
+
+int KernelClass::DispatchMessages(void)
+{
+	unsigned int depth;
+	unsigned long budget;
+	unsigned long start;
+	unsigned long used;
+	int count;
+
+	SchedStats.Passes++;
+
+	#if KERNEL_IDLE_SLEEP
+	if(WakePending) {
+		PassStart=TimerService::Now();
+	}
+	#endif
+
+	depth=MessageQueue.GetDepth();
+
+	// nothing queued: don't spend time on the clock or the rings
+
+	if(!depth) {
+		SchedStats.Idle++;
+		return 0;
+	}
+
+	start=TimerService::Now();
+	switch(SchedPolicy) {
+		case KSCHED_BUDGET:
+			budget=SchedParam;
+			count=MessageQueue.LoopFor(budget);
+			break;
+
+		case KSCHED_ADAPTIVE:
+			budget=((unsigned long)SchedParam*IMIN(depth,KSCHED_ADAPT_DEPTH))/KSCHED_ADAPT_DEPTH;
+			budget=IMAX(budget,KSCHED_MIN_BUDGET);
+			count=MessageQueue.LoopFor(budget);
+			break;
+
+		default:
+			budget=0;
+			count=MessageQueue.Loop(SchedParam);
+			break;
+	}
+	used=TimerService::Now()-start;
+
+	SchedStats.Messages+=count;
+	SchedStats.Granted+=budget;
+	SchedStats.Used+=used;
+	if(used>SchedStats.WorstPass) {
+		SchedStats.WorstPass=IMIN(used,0xffff);
+	}
+	if(MessageQueue.GetDepth()) {
+		SchedStats.Exhausted++;
+	} else {
+		SchedStats.Drained++;
+	}
+	return count;
+}
+
 }
@@ -13,13 +13,272 @@
 #include "taskring.h"
 #include "mq.h"
 #include "iic.h"
+#include "timerservice.h"
 
 namespace Kernel {
 
+	//
+	// Message scheduling policy for each pass of loop(). Messages are dispatched
+	// first, then one task step is run.
+	//
+	// KSCHED_FIXED:	dispatch up to 'param' messages (the original behaviour)
+	// KSCHED_BUDGET:	dispatch until the queue is empty or 'param' microseconds
+	//					have been spent
+	// KSCHED_ADAPTIVE:	as KSCHED_BUDGET, but the budget scales with queue depth,
+	//					from KSCHED_MIN_BUDGET up to 'param' microseconds once
+	//					KSCHED_ADAPT_DEPTH messages are queued
+
+	typedef enum KSCHEDPOLICY {
+		KSCHED_FIXED,
+		KSCHED_BUDGET,
+		KSCHED_ADAPTIVE
+	};
+
+	#ifndef KSCHED_MIN_BUDGET
+	#define KSCHED_MIN_BUDGET		200		// us
+	#endif
+
+	#ifndef KSCHED_ADAPT_DEPTH
+	#define KSCHED_ADAPT_DEPTH		8		// messages
+	#endif
+
+	//
+	// Idle sleep. With KERNEL_IDLE_SLEEP set, a pass of loop() that finds no
+	// message and no ready task puts the CPU into idle sleep until the next
+	// interrupt. Timer service deadlines (timerservice.h) wake it through the
+	// Timer2 compare, and the Timer2 overflow (the kernel clock) interrupts
+	// every 256 ticks (512us by default, see TIMER_PRESCALE), so task WakeIn
+	// deadlines and periodic releases are still noticed on time. The same
+	// overflow limits how long a sleep can last. A pass with a polled IIC transfer on the bus (see
+	// iic.h) counts as busy.
+	//
+	// KERNEL_PRR_GATE is the set of PRR bits powered down at start-up: the
+	// peripherals the firmware does not use. The ADC (and the analog comparator)
+	// and SPI are unused; USART0, TWI and the timers are.
+
+	#ifndef KERNEL_IDLE_SLEEP
+	#define KERNEL_IDLE_SLEEP		1
+	#endif
+
+	#ifndef KERNEL_PRR_GATE
+	#define KERNEL_PRR_GATE			(_BV(PRADC)|_BV(PRSPI))
+	#endif
+
+	//
+	// Idle statistics, see GetIdleStats. Times in microseconds; the window is
+	// measured with TimerService::Now(), so reset the statistics at least hourly.
+
+	typedef struct KIDLESTATS {
+		unsigned long	Window;			// time since the statistics were reset
+		unsigned long	Asleep;			// time spent in idle sleep
+		uint8_t			IdlePercent;	// Asleep as a percentage of Window
+		unsigned long	Sleeps;			// times the CPU slept
+		unsigned long	Wakes;			// wakes followed by work (not just a timer tick)
+		unsigned long	LatencyWorst;	// longest wake-to-work time
+		unsigned long	LatencyMean;	// mean wake-to-work time
+	} KIDLESTATS;
+
+	//
+	// Task watchdog (TASK_WATCHDOG, see Task.h). The AVR watchdog timer runs in
+	// interrupt-then-reset mode with a KERNEL_WDT_TIMEOUT period, and is kicked
+	// once per pass of loop(). If loop() stalls - a task or message handler
+	// that never returns - the WDT interrupt records a KRESET_HANG naming the
+	// task that was running, and the reset follows one period later. That
+	// record is provisional (kept at KERNEL_WDT_PENDING_EEADDR) until the
+	// reset happens: if loop() recovers in time it is dropped and the
+	// interrupt re-armed, so a transient stall neither counts as a reset nor
+	// leaves the next real hang unrecorded.
+	//
+	// Each pass the kernel also checks the tasks put under watch with
+	// Task::Watch: overruns are logged, and a task that misses its heartbeat
+	// is logged and the device reset in a controlled way (KRESET_STARVED).
+	// Either way the reset leaves the outputs, and so the motor PWM, off.
+	//
+	// The reason is kept in a KRESETRECORD at KERNEL_WDT_EEADDR in the on-chip
+	// EEPROM (the last bytes by default) for GetResetRecord after restart.
+
+	#ifndef KERNEL_WDT_TIMEOUT
+	#define KERNEL_WDT_TIMEOUT		WDTO_1S
+	#endif
+
+	#ifndef KERNEL_WDT_EEADDR
+	#define KERNEL_WDT_EEADDR		(E2END+1-sizeof(Kernel::KRESETRECORD))
+	#endif
+
+	#ifndef KERNEL_WDT_PENDING_EEADDR
+	#define KERNEL_WDT_PENDING_EEADDR	(KERNEL_WDT_EEADDR-sizeof(Kernel::KRESETRECORD))
+	#endif
+
+	#define KRESET_MAGIC			0xa5
+	#define KRESET_HANG				1		// loop() stalled, the WDT interrupt fired
+	#define KRESET_STARVED			2		// a watched task missed its heartbeat
+
+	typedef struct KRESETRECORD {
+		uint8_t			Magic;			// KRESET_MAGIC if the record is valid
+		uint8_t			Reason;			// KRESET_*
+		uint8_t			Count;			// watchdog resets since the record was cleared
+		uint16_t		Task;			// address of the task, zero if none was running
+		char			Name[8];		// its SetName name, unterminated if 8 long
+		unsigned long	Uptime;			// millis() at the reset
+	} KRESETRECORD;
+
+	//
+	// Scheduler statistics, see GetSchedStats. Times in microseconds.
+
+	typedef struct KSCHEDSTATS {
+		unsigned long	Passes;			// scheduler passes
+		unsigned long	Messages;		// messages dispatched
+		unsigned long	Granted;		// total budget granted
+		unsigned long	Used;			// total time spent dispatching
+		unsigned int	Exhausted;		// passes that ended with messages still queued
+		unsigned int	Drained;		// passes that emptied the queue
+		unsigned int	Idle;			// passes that found nothing to dispatch
+		unsigned int	WorstPass;		// longest single dispatch pass
+	} KSCHEDSTATS;
+
 	class KernelClass {
 
 		private:
 
+			friend void ::loop();		// the kernel loop runs the scheduling pass
+			friend void ::setup();		// and setup powers down unused peripherals and starts the watchdog
+
+			KSCHEDPOLICY	SchedPolicy;
+			unsigned int	SchedParam;
+			KSCHEDSTATS		SchedStats;
+
+			#if KERNEL_IDLE_SLEEP
+			KIDLESTATS		IdleStats;
+			unsigned long	IdleWindowStart;	// TimerService::Now() when the idle statistics were reset
+			unsigned long	IdleLatencyTotal;
+			unsigned long	WakeTime;			// TimerService::Now() on leaving the last sleep
+			boolean			WakePending;		// slept, and the following pass is not yet accounted
+			unsigned long	PassStart;			// TimerService::Now() at the start of that pass
+			#endif
+
+			#if TASK_WATCHDOG
+			Print *			WatchdogOut;		// watchdog log, NULL if off
+			#endif
+
+			#if TASK_PROFILE
+			Print *			ProfileOut;			// periodic profile dump, NULL if off
+			unsigned long	ProfilePeriod;		// ms
+			unsigned long	ProfileLast;		// millis() of the last dump
+			#endif
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// DispatchMessages
+			///
+			/// Run one message dispatch pass according to the scheduling policy,
+			/// and account for it in the statistics.
+			///
+			/// @scope: PRIVATE
+			/// @context: TASK
+			/// @param: none
+			/// @return: int - number of messages dispatched
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			int DispatchMessages(void);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// PowerInit
+			///
+			/// Power down the peripherals in KERNEL_PRR_GATE. Called from setup(),
+			/// after the Arduino core has enabled the ADC.
+			///
+			/// @scope: PRIVATE
+			/// @context: TASK
+			/// @param: none
+			/// @return: none
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void PowerInit(void);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// Idle
+			///
+			/// End of a pass of loop(): account for the wake that led to it, and if the
+			/// pass did no work and none is pending, sleep until the next interrupt.
+			///
+			/// @scope: PRIVATE
+			/// @context: TASK
+			/// @param: boolean busy - true if the pass dispatched a message or ran a task
+			/// @return: none
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void Idle(boolean busy);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// Housekeeping
+			///
+			/// Periodic kernel services run once per pass of loop(), after the task
+			/// step: the watchdog, and the profile dump (see SetProfileDump).
+			///
+			/// @scope: PRIVATE
+			/// @context: TASK
+			/// @param: none
+			/// @return: none
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void Housekeeping(void);
+
+			#if TASK_WATCHDOG
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// WatchdogInit
+			///
+			/// Start the watchdog timer. Called from setup() once UserInit has
+			/// finished, so a slow start-up is not mistaken for a hang. Reports the
+			/// reset record, if there is one, to the watchdog log.
+			///
+			/// @scope: PRIVATE
+			/// @context: TASK
+			/// @param: none
+			/// @return: none
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void WatchdogInit(void);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// WatchdogService
+			///
+			/// Kick the watchdog timer, re-arm its interrupt if a stall was
+			/// recovered from, and check the watched tasks. Called each pass from
+			/// Housekeeping.
+			///
+			/// @scope: PRIVATE
+			/// @context: TASK
+			/// @param: none
+			/// @return: none
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void WatchdogService(void);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// RecordReset
+			///
+			/// Write the reset record to EEPROM.
+			///
+			/// @scope: PRIVATE
+			/// @context: ANY
+			/// @param: uint8_t reason - KRESET_*
+			/// @param: PTASKNODE pTask - the task responsible, NULL if none
+			/// @param: boolean pending - write the provisional record, not the
+			///                           reset record
+			/// @return: none
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void RecordReset(uint8_t reason, PTASKNODE pTask, boolean pending);
+
+			#endif
+
 		public:
 
 			/// Accessible members
@@ -27,6 +286,7 @@ namespace Kernel {
 			TaskRing&	TaskManager=TaskRing::Get();
 			MQClass&	MessageQueue=MQClass::Get();
             IIC&        IICDriver=IIC::Get();
+			TimerService&	Timers=TimerService::Get();
 
 			////////////////////////////////////////////////////////////////////////////////
 			/// KernelClass
@@ -50,6 +310,165 @@ namespace Kernel {
 			///////////////////////////////////////////////////////////////////////////////
 
 			~KernelClass();
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// SetSchedPolicy
+			///
+			/// Select the message scheduling policy used by each pass of loop().
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: KSCHEDPOLICY policy
+			/// @param: unsigned int param - message count for KSCHED_FIXED, budget
+			///         (maximum budget for KSCHED_ADAPTIVE) in microseconds otherwise
+			/// @return: none
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void SetSchedPolicy(KSCHEDPOLICY policy, unsigned int param);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// GetSchedStats
+			///
+			/// Obtain a copy of the scheduler statistics.
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: KSCHEDSTATS * stats - receives the statistics
+			/// @return: none
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void GetSchedStats(KSCHEDSTATS * stats);
+
+			#if KERNEL_IDLE_SLEEP
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// GetIdleStats
+			///
+			/// Obtain the idle statistics: the fraction of time spent asleep (a direct
+			/// CPU load figure), and the wake-up latency - from leaving sleep to the
+			/// start of the pass that handles whatever woke the CPU.
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: KIDLESTATS * stats - receives the statistics
+			/// @return: none
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void GetIdleStats(KIDLESTATS * stats);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// ResetIdleStats
+			///
+			/// Zero the idle statistics and start a new window.
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: none
+			/// @return: none
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void ResetIdleStats(void);
+
+			#endif
+
+			#if TASK_PROFILE
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// SetProfileDump
+			///
+			/// Print the task profile (TaskRing::DumpProfile) every period
+			/// milliseconds, then the IIC traffic (IIC::DumpStats, if IIC_STATS),
+			/// followed by an idle line (if KERNEL_IDLE_SLEEP)
+			///
+			///		IDLE,<idle %>,<sleeps>,<wakes>,<latency worst>,<latency mean>
+			///
+			/// after which the idle statistics are reset, so each line covers one
+			/// period. A NULL output or zero period turns the dump off.
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: Print * out - where to print (e.g. &Serial)
+			/// @param: unsigned long period - in milliseconds
+			/// @return: none
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void SetProfileDump(Print * out, unsigned long period);
+
+			#endif
+
+			#if TASK_WATCHDOG
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// SetWatchdogLog
+			///
+			/// Report watchdog events to out, one line each:
+			///
+			///		WD,OVERRUN,<name>			a watched task overran its maxrun
+			///		WD,STARVED,<name>			a watched task missed its heartbeat (reset follows)
+			///		WD,RESET,<reason>,<count>,<name>,<uptime ms>
+			///									the reset record, at start-up, while there is one
+			///
+			/// A NULL output turns the log off.
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: Print * out - where to log (e.g. &Serial)
+			/// @return: none
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void SetWatchdogLog(Print * out) { WatchdogOut=out; };
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// GetResetRecord
+			///
+			/// Read the record of the last watchdog reset from EEPROM.
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: KRESETRECORD * record - receives the record
+			/// @return: boolean - true if there is a record
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			boolean GetResetRecord(KRESETRECORD * record);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// ClearResetRecord
+			///
+			/// Erase the reset record, and with it the reset count.
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: none
+			/// @return: none
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void ClearResetRecord(void);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// WatchdogExpired
+			///
+			/// Called from the WDT interrupt only: loop() has not kicked the watchdog
+			/// for a whole period. Records a provisional KRESET_HANG; the reset
+			/// follows unless loop() recovers first.
+			///
+			/// @scope: INTERNAL
+			/// @context: INTERRUPT
+			/// @param: none
+			/// @return: none
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void WatchdogExpired(void);
+
+			#endif
 	};
 
 }
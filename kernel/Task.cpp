@@ -7,6 +7,8 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #include "kernel.h"
+#include <util/atomic.h>
+#include <limits.h>
 
 namespace Kernel {
 
@@ -48,4 +50,300 @@ namespace Kernel {
 		Kernel::OS.TaskManager.RegisterTaskHandler(this);
 	}
 
+	///////////////////////////////////////////////////////////////////////////////
+	/// Start (periodic)
+	///
+	/// Start the task as a periodic task at the given priority.
+	///
+	/// @scope: PUBLIC
+	/// @context: TASK
+	/// @param: unsigned long period - in milliseconds
+	/// @param: uint8_t priority - TASK_PRIORITY_*, lower is more urgent
+	/// @return: NONE
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	void Task::Start(unsigned long period, uint8_t priority)
+	{
+		Priority=priority;
+		WakeEvery(period);
+		Start();
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// Suspend
+	///
+	/// Park the task until Resume.
+	///
+	/// @scope: PUBLIC
+	/// @context: TASK
+	/// @param: NONE
+	/// @return: NONE
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	void Task::Suspend(void)
+	{
+		Kernel::OS.TaskManager.SuspendTaskHandler(this);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// Resume
+	///
+	/// Return a suspended task to the scheduler.
+	///
+	/// @scope: PUBLIC
+	/// @context: TASK
+	/// @param: NONE
+	/// @return: NONE
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	void Task::Resume(void)
+	{
+		Kernel::OS.TaskManager.ResumeTaskHandler(this);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// GetSchedStats
+	///
+	/// Obtain the periodic release statistics.
+	///
+	/// @scope: PUBLIC
+	/// @context: TASK
+	/// @param: TASKSCHEDSTATS * stats - receives the statistics
+	/// @return: NONE
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	void Task::GetSchedStats(TASKSCHEDSTATS * stats)
+	{
+		if(stats) {
+			*stats=SchedStats;
+		}
+	}
+
+	#if TASK_WATCHDOG
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// Watch
+	///
+	/// Put the task under the kernel watchdog. The first heartbeat is due a
+	/// heartbeat period from now.
+	///
+	/// @scope: PUBLIC
+	/// @context: TASK
+	/// @param: unsigned long heartbeat - in milliseconds
+	/// @param: unsigned int maxrun - in milliseconds
+	/// @return: NONE
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	void Task::Watch(unsigned long heartbeat, unsigned int maxrun)
+	{
+		WatchBeat=heartbeat;
+		WatchRun=maxrun;
+		LastBeat=millis();
+	}
+
+	#endif
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// WakeOnMessage
+	///
+	/// Run the task after the message queue has dispatched the given msgid.
+	///
+	/// @scope: PUBLIC
+	/// @context: TASK
+	/// @param: int msgid - message ID, must be below 32
+	/// @return: int - zero if successful, nonzero if error occurred
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	int Task::WakeOnMessage(int msgid)
+	{
+		int rc=-1;
+		if((msgid>=0) && (msgid<32)) {
+			WakeMsgs|=(1UL<<msgid);
+			Polled=false;
+			rc=0;
+		}
+		return rc;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// WakeEvery
+	///
+	/// Run the task every period milliseconds, starting a period from now. Zero
+	/// cancels the periodic wake.
+	///
+	/// @scope: PUBLIC
+	/// @context: TASK
+	/// @param: unsigned long period - in milliseconds
+	/// @return: NONE
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	void Task::WakeEvery(unsigned long period)
+	{
+		WakePeriod=period*1000UL;
+		NextRelease=TimerService::Now()+WakePeriod;
+		Polled=false;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// WakeIn
+	///
+	/// Run the task once, with TASK_EVENT_TIMEOUT, after ms milliseconds.
+	///
+	/// @scope: PUBLIC
+	/// @context: TASK
+	/// @param: unsigned long ms - delay in milliseconds
+	/// @return: NONE
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	void Task::WakeIn(unsigned long ms)
+	{
+		WakeDeadline=TimerService::Now()+ms*1000UL;
+		WakeArmed=(ms!=0);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// WakeOnSignal
+	///
+	/// Declare that the task is woken by Signal only.
+	///
+	/// @scope: PUBLIC
+	/// @context: TASK
+	/// @param: NONE
+	/// @return: NONE
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	void Task::WakeOnSignal(void)
+	{
+		Polled=false;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// Signal
+	///
+	/// Raise wake events for the task. Safe to call from an ISR: the update is
+	/// made with interrupts masked, so a task-time Signal can't lose an event
+	/// raised by an ISR mid-way through it.
+	///
+	/// @scope: PUBLIC
+	/// @context: ANY
+	/// @param: uint8_t events - events to raise
+	/// @return: NONE
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	void Task::Signal(uint8_t events)
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			Events|=events;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// IsReady
+	///
+	/// Check whether the task should run on this pass, raising the WakeIn
+	/// timeout and releasing the periodic job if their time has come. Each
+	/// release is due by the next, so a release that finds the previous one
+	/// still waiting is a deadline miss: the waiting job keeps its original
+	/// release time and the new one is dropped. If the loop stalled for more
+	/// than a period the missed releases are not made up; the schedule
+	/// restarts a period from now.
+	///
+	/// @scope: PRIVATE
+	/// @context: TASK
+	/// @param: unsigned long now - TimerService::Now()
+	/// @return: boolean - true if the task should run
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	boolean Task::IsReady(unsigned long now)
+	{
+		if(WakeArmed && ((long)(now-WakeDeadline)>=0)) {
+			WakeArmed=false;
+			Signal(TASK_EVENT_TIMEOUT);
+		}
+		if(WakePeriod && ((long)(now-NextRelease)>=0)) {
+			if(Events & TASK_EVENT_TIMER) {
+				SchedStats.Missed++;
+			} else {
+				JobRelease=NextRelease;
+				Signal(TASK_EVENT_TIMER);
+			}
+			NextRelease+=WakePeriod;
+			if((long)(now-NextRelease)>=0) {
+				SchedStats.Missed++;
+				NextRelease=now+WakePeriod;
+			}
+		}
+		return Polled || Events;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// Slack
+	///
+	/// Time left before the pending work is due: the next release for a pending
+	/// periodic job, none at all for any other wake event, and LONG_MAX for a
+	/// polled task with nothing pending.
+	///
+	/// @scope: PRIVATE
+	/// @context: TASK
+	/// @param: unsigned long now - TimerService::Now()
+	/// @return: long - microseconds to the deadline
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	long Task::Slack(unsigned long now)
+	{
+		uint8_t events=Events;
+		long slack=LONG_MAX;
+
+		if(events & TASK_EVENT_TIMER) {
+			slack=(long)(JobRelease+WakePeriod-now);
+		}
+		if(events & ~TASK_EVENT_TIMER) {
+			slack=IMIN(slack,0);
+		}
+		return slack;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// Run
+	///
+	/// Collect and clear the pending events, then call TaskLoop. Events raised
+	/// while TaskLoop runs stay pending for the next pass.
+	///
+	/// @scope: PRIVATE
+	/// @context: TASK
+	/// @param: NONE
+	/// @return: NONE
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	void Task::Run(void)
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			Woken=Events;
+			Events=0;
+		}
+
+		if(Woken & TASK_EVENT_TIMER) {
+			unsigned long jitter=TimerService::Now()-JobRelease;
+			SchedStats.Releases++;
+			SchedStats.JitterTotal+=jitter;
+			if(jitter>SchedStats.JitterWorst) {
+				SchedStats.JitterWorst=jitter;
+			}
+		}
+		TaskLoop();
+	}
+
 };
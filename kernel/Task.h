@@ -9,12 +9,166 @@
 #ifndef TASK_H_
 #define TASK_H_
 
+#include "sysincs.h"
 #include "EventReceiver.h"
 
+//
+// Task wake events. A task that declares any wake source (WakeOnMessage,
+// WakeEvery, WakeOnSignal) is only run when one of these is pending; the
+// set that woke it is available from WokenBy() during TaskLoop. Bits
+// 0x01-0x10 are free for the task's own use with Signal.
+
+#define TASK_EVENT_SIGNAL		0x01		// default Signal() event
+#define TASK_EVENT_TIMEOUT		0x20		// WakeIn delay elapsed
+#define TASK_EVENT_TIMER		0x40		// WakeEvery period elapsed
+#define TASK_EVENT_MESSAGE		0x80		// a WakeOnMessage msgid was dispatched
+
+//
+// Task priorities. Lower is more urgent. Among the tasks ready on a pass the
+// scheduler runs the most urgent priority first, then the earliest deadline
+// within it: a periodic release is due by its next release, any other wake
+// is due at once, and a task that is merely polled comes last.
+
+#define TASK_PRIORITY_HIGHEST	0
+#define TASK_PRIORITY_DEFAULT	128
+#define TASK_PRIORITY_LOWEST	255
+
+//
+// Set TASK_PROFILE to 0 to leave out the per-task CPU time profile (see
+// TaskRing::GetTaskProfile). It costs 16 bytes of RAM per registered task and
+// two TimerService::Now() reads per task call.
+
+#ifndef TASK_PROFILE
+#define TASK_PROFILE		1
+#endif
+
+//
+// Set TASK_WATCHDOG to 0 to leave out the task watchdog (see Task::Watch and
+// KernelClass.h). It costs 10 bytes of RAM per task.
+
+#ifndef TASK_WATCHDOG
+#define TASK_WATCHDOG		1
+#endif
+
 namespace Kernel {
 
+	#if TASK_PROFILE
+
+	//
+	// per-task CPU time, see TaskRing::GetTaskProfile. Times in microseconds,
+	// measured with the kernel clock (TimerService::Now), so with 2us
+	// resolution by default.
+
+	typedef struct TASKPROFILE {
+		unsigned long	Calls;			// times the task has been run
+		unsigned long	Total;			// total time spent in the task
+		unsigned long	Worst;			// longest single call
+		unsigned long	Last;			// most recent call
+	} TASKPROFILE;
+
+	#endif
+
+	//
+	// A registration in the task ring. Each Task carries its own, and function
+	// tasks take one from a static pool in the task ring, so registering never
+	// allocates. The scheduler tells the two apart by Flags, not by a vtable.
+
+	#define TASKNODE_FUNCTION		0x01	// Owner is a PFNTASKHANDLER, not a Task
+	#define TASKNODE_OVERRUN		0x02	// the task overran its maximum run time, not yet reported
+
+	typedef struct TASKNODE *	PTASKNODE;
+	typedef struct TASKNODE {
+		PTASKNODE		pNext;			// ready list
+		PTASKNODE		pPrev;
+		void *			Owner;			// the Task or function, NULL if not registered
+		uint8_t			Flags;			// TASKNODE_*
+		#if TASK_PROFILE
+		TASKPROFILE		Profile;
+		#endif
+	} TASKNODE;
+
+	//
+	// Periodic release statistics, see Task::GetSchedStats. Times in microseconds.
+
+	typedef struct TASKSCHEDSTATS {
+		unsigned long	Releases;		// periodic releases run
+		unsigned int	Missed;			// releases not started by their deadline
+		unsigned long	JitterWorst;	// longest release-to-start delay
+		unsigned long	JitterTotal;	// total release-to-start delay
+	} TASKSCHEDSTATS;
+
 	class Task : public EventReceiver {
 
+		private:
+
+			friend class TASKNODEOPS;	// the scheduler's node operations read and clear the wake state
+			friend class TaskRing;		// the scheduler keeps our registration
+
+			TASKNODE			Node;		// our registration in the task ring
+			boolean				Suspended;	// off the ready list
+			const char *		Name;		// for reports, NULL if not named
+
+			volatile uint8_t	Events;		// pending wake events (set from any context)
+			uint8_t				Woken;		// events that woke the current TaskLoop
+			boolean				Polled;		// no wake source declared: run every pass
+			uint8_t				Priority;	// TASK_PRIORITY_*, lower is more urgent
+			uint32_t			WakeMsgs;	// bit n set: wake on msgid n
+			unsigned long		WakePeriod;	// us, zero if no periodic wake
+			unsigned long		NextRelease;// TimerService::Now() of the next periodic release
+			unsigned long		JobRelease;	// TimerService::Now() of the release now pending
+			unsigned long		WakeDeadline;// TimerService::Now() of the WakeIn timeout
+			boolean				WakeArmed;	// WakeIn timeout outstanding
+			TASKSCHEDSTATS		SchedStats;
+			#if TASK_WATCHDOG
+			unsigned long		WatchBeat;	// ms allowed between heartbeats, zero if not watched
+			unsigned long		LastBeat;	// millis() of the last heartbeat
+			unsigned int		WatchRun;	// ms allowed for one TaskLoop call, zero if not watched
+			#endif
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// IsReady
+			///
+			/// Check whether the task should run on this pass, releasing the periodic
+			/// job (TASK_EVENT_TIMER) if its time has come.
+			///
+			/// @scope: PRIVATE
+			/// @context: TASK
+			/// @param: unsigned long now - TimerService::Now()
+			/// @return: boolean - true if the task should run
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			boolean IsReady(unsigned long now);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// Slack
+			///
+			/// Time left before the pending work is due, used to order ready tasks of
+			/// the same priority.
+			///
+			/// @scope: PRIVATE
+			/// @context: TASK
+			/// @param: unsigned long now - TimerService::Now()
+			/// @return: long - microseconds to the deadline (LONG_MAX if none)
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			long Slack(unsigned long now);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// Run
+			///
+			/// Collect and clear the pending events, then call TaskLoop.
+			///
+			/// @scope: PRIVATE
+			/// @context: TASK
+			/// @param: NONE
+			/// @return: NONE
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void Run(void);
+
 		public:
 
 			///////////////////////////////////////////////////////////////////////////////
@@ -30,7 +184,13 @@ namespace Kernel {
 			///
 			///////////////////////////////////////////////////////////////////////////////
 
-			Task() {};
+			Task() : Node(),Suspended(false),Name(NULL),Events(0),Woken(0),Polled(true),Priority(TASK_PRIORITY_DEFAULT),WakeMsgs(0),
+			         WakePeriod(0),NextRelease(0),JobRelease(0),
+			         WakeDeadline(0),WakeArmed(false),SchedStats()
+			#if TASK_WATCHDOG
+			         ,WatchBeat(0),LastBeat(0),WatchRun(0)
+			#endif
+			         {};
 
 			///////////////////////////////////////////////////////////////////////////////
 			/// ~Task
@@ -76,6 +236,246 @@ namespace Kernel {
 
 			void Start(void);
 
+			///////////////////////////////////////////////////////////////////////////////
+			/// Start (periodic)
+			///
+			/// Start the task as a periodic task: it is released every period
+			/// milliseconds (as WakeEvery) and scheduled at the given priority. Each
+			/// release is due by the next one.
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: unsigned long period - in milliseconds
+			/// @param: uint8_t priority - TASK_PRIORITY_*, lower is more urgent
+			/// @return: NONE
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void Start(unsigned long period, uint8_t priority);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// SetPriority
+			///
+			/// Set the priority the task is scheduled at.
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: uint8_t priority - TASK_PRIORITY_*, lower is more urgent
+			/// @return: NONE
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void SetPriority(uint8_t priority) { Priority=priority; };
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// GetSchedStats
+			///
+			/// Obtain the periodic release statistics: how many releases have run, how
+			/// many missed their deadline (were still waiting, or had not been released,
+			/// when the next one fell due) and the release-to-start jitter.
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: TASKSCHEDSTATS * stats - receives the statistics
+			/// @return: NONE
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void GetSchedStats(TASKSCHEDSTATS * stats);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// Suspend
+			///
+			/// Park the task: the scheduler stops visiting it, so it costs nothing per
+			/// pass, until Resume. Events signalled meanwhile are kept and it runs on
+			/// them once resumed; message wakes are not recorded while suspended.
+			/// May be called before Start, or by the task from its own TaskLoop.
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: NONE
+			/// @return: NONE
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void Suspend(void);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// Resume
+			///
+			/// Return a suspended task to the scheduler.
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: NONE
+			/// @return: NONE
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void Resume(void);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// IsSuspended
+			///
+			/// @scope: PUBLIC
+			/// @context: ANY
+			/// @param: NONE
+			/// @return: boolean - true if the task is suspended
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			boolean IsSuspended(void) { return Suspended; };
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// SetName
+			///
+			/// Name the task in kernel reports such as TaskRing::DumpProfile. The string
+			/// is not copied, so it must outlive the task (normally a literal).
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: const char * name
+			/// @return: NONE
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void SetName(const char * name) { Name=name; };
+
+			#if TASK_WATCHDOG
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// Watch
+			///
+			/// Put the task under the kernel watchdog. Once watched, the task must call
+			/// Heartbeat at least every heartbeat milliseconds or it is reported as
+			/// starved and the kernel resets the device (see KernelClass.h). A TaskLoop
+			/// call that takes longer than maxrun milliseconds is reported as an
+			/// overrun. Zero turns either check off. A task that never returns is
+			/// caught by the hardware watchdog whatever its settings.
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: unsigned long heartbeat - in milliseconds
+			/// @param: unsigned int maxrun - in milliseconds
+			/// @return: NONE
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void Watch(unsigned long heartbeat, unsigned int maxrun);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// Heartbeat
+			///
+			/// Tell the watchdog the task is making progress. Call it where the task
+			/// does its real work, not simply on every wake, so that a task stuck
+			/// waiting for something that never comes is caught.
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: NONE
+			/// @return: NONE
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void Heartbeat(void) { LastBeat=millis(); };
+
+			#endif
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// WakeOnMessage
+			///
+			/// Run the task after the message queue has dispatched the given msgid (to
+			/// any receiver). The task's own EventHandler, if routed, has already run
+			/// by then, so it can simply record the message and leave the work to
+			/// TaskLoop.
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: int msgid - message ID, must be below 32
+			/// @return: int - zero if successful, nonzero if error occurred
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			int WakeOnMessage(int msgid);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// WakeEvery
+			///
+			/// Run the task every period milliseconds, starting a period from now. Zero
+			/// cancels the periodic wake.
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: unsigned long period - in milliseconds
+			/// @return: NONE
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void WakeEvery(unsigned long period);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// WakeIn
+			///
+			/// Run the task once, with TASK_EVENT_TIMEOUT, after ms milliseconds. A
+			/// second call replaces the first; zero cancels it. Unlike the other Wake
+			/// functions this does not stop a polled task being run on every pass.
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: unsigned long ms - delay in milliseconds
+			/// @return: NONE
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void WakeIn(unsigned long ms);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// WakeOnSignal
+			///
+			/// Declare that the task is woken by Signal only. Calling any of the Wake
+			/// functions stops the task being run on every pass; this one is for tasks
+			/// that have no message or timer source.
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: NONE
+			/// @return: NONE
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void WakeOnSignal(void);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// Signal
+			///
+			/// Raise wake events for the task, so it runs on a following pass. Safe to
+			/// call from an ISR. A task can also signal itself from TaskLoop to be run
+			/// again while it has work in hand.
+			///
+			/// @scope: PUBLIC
+			/// @context: ANY
+			/// @param: uint8_t events - events to raise (TASK_EVENT_SIGNAL by default)
+			/// @return: NONE
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void Signal(uint8_t events=TASK_EVENT_SIGNAL);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// WokenBy
+			///
+			/// The events that caused the current TaskLoop call. Zero for a polled task
+			/// that had no events pending.
+			///
+			/// @scope: PUBLIC
+			/// @context: TASK
+			/// @param: NONE
+			/// @return: uint8_t - TASK_EVENT_* bits
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			uint8_t WokenBy(void) { return Woken; };
+
 	};
 }
 
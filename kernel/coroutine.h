@@ -0,0 +1,83 @@
+///////////////////////////////////////////////////////////////////////////////
+/// coroutine.h
+///
+/// Stackless coroutines for tasks
+///
+/// Protothread-style macros that let a Task's TaskLoop be written as straight
+/// line code which gives up the CPU part way through and carries on from the
+/// same point on a later pass. The toolchain is C++11, so C++20 co_await is
+/// not available; these use the switch/__LINE__ technique instead.
+///
+/// The whole coroutine state is one COSTATE member of the task. Because the
+/// function returns at each wait, local variables do not survive across a
+/// CO_ macro: keep anything that must in members. Only one CO_ macro may
+/// appear on a source line, and a coroutine body can not contain a switch
+/// statement of its own around a CO_ macro.
+///
+///		void MyTask::TaskLoop(void)
+///		{
+///			CO_BEGIN(this->co);
+///			DoFirstPart();
+///			CO_YIELD(this->co);				// let other tasks run
+///			DoSecondPart();
+///			CO_AWAIT_TIMER(this->co,100);	// sleep for 100ms
+///			CO_WAIT_UNTIL(this->co,this->flag);
+///			CO_END(this->co);				// next wake starts at the top again
+///		}
+///
+/// The task only runs when woken (see Task.h), so a CO_WAIT_UNTIL condition is
+/// re-tested on each wake: declare the wake source that changes it, usually a
+/// WakeOnMessage for the msgid whose EventHandler sets it.
+///
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef _COROUTINE_H_
+#define _COROUTINE_H_
+
+#include "Task.h"
+
+namespace Kernel {
+
+	//
+	// where a coroutine resumes: zero at the top, otherwise the source line of
+	// the CO_ macro it is suspended in
+
+	typedef uint16_t COSTATE;
+
+}
+
+//
+// start and end of the coroutine body. After CO_END the next wake runs the
+// body from the top again.
+
+#define CO_BEGIN(co)				switch(co) { case 0:
+#define CO_END(co)					} (co)=0
+
+//
+// suspend until cond is true. cond is tested straight away, so this does not
+// give up the CPU if it already holds.
+
+#define CO_WAIT_UNTIL(co,cond)		do { (co)=__LINE__; case __LINE__: if(!(cond)) return; } while(0)
+
+//
+// give up the CPU and carry on at the next pass. The task signals itself so
+// the scheduler comes back to it.
+
+#define CO_YIELD(co)				do { (co)=__LINE__; this->Signal(TASK_EVENT_SIGNAL); return; case __LINE__:; } while(0)
+
+//
+// suspend for ms milliseconds (using the task's WakeIn timeout)
+
+#define CO_AWAIT_TIMER(co,ms)		do { this->WakeIn(ms); (co)=__LINE__; case __LINE__: if(!(this->WokenBy() & TASK_EVENT_TIMEOUT)) return; } while(0)
+
+//
+// suspend until the task is woken by one of its WakeOnMessage msgids
+
+#define CO_AWAIT_MESSAGE(co)		do { (co)=__LINE__; return; case __LINE__: if(!(this->WokenBy() & TASK_EVENT_MESSAGE)) return; } while(0)
+
+//
+// restart the coroutine from the top on the next wake
+
+#define CO_RESTART(co)				do { (co)=0; return; } while(0)
+
+#endif
@@ -3,173 +3,1197 @@
 ///
 /// IIC peripheral driver for ATMega328p
 ///
+/// The transfer engine is a state machine on the TWI status code, out of the
+/// data sheet. Step handles one bus event each time TWINT is set: from the
+/// TWI interrupt with IIC_INTERRUPT, otherwise from Poll.
+///
 /// Dr J A Gow 2022
 ///
 ///////////////////////////////////////////////////////////////////////////////
 
-#include <Arduino.h>
-#include "iic.h"
+#include <Arduino.h>
+#include <util/atomic.h>
+#include "iic.h"
+#include "mq.h"
+#include "timerservice.h"
+
+//
+// TWCR values. IIC_TWCR_GO clears TWINT to let the TWI carry on, with the
+// interrupt enabled if the engine runs from it.
+
+#if IIC_INTERRUPT
+#define IIC_TWCR_GO         (_BV(TWINT)|_BV(TWEN)|_BV(TWIE))
+#define IIC_MQ_CONTEXT      MQ_CONTEXT_INTERRUPT
+#else
+#define IIC_TWCR_GO         (_BV(TWINT)|_BV(TWEN))
+#define IIC_MQ_CONTEXT      MQ_CONTEXT_TASK
+#endif
+
+#define IIC_TWCR_STOP       (_BV(TWINT)|_BV(TWEN)|_BV(TWSTO))
+
+//
+// how a transfer is ended on the bus (see Finish)
+
+#define IIC_END_STOP        0       // send a STOP
+#define IIC_END_RELEASE     1       // arbitration lost: the bus is not ours
+#define IIC_END_RESET       2       // recover the bus and restart the TWI
+
+//
+// the TWI pins, driven by hand for bus recovery. Open drain: a pin is pulled
+// low as an output, or released as an input with its pull-up.
+
+#define IIC_SCL             PC5
+#define IIC_SDA             PC4
+
+#define IIC_PIN_LOW(bit)        do { PORTC &= ~_BV(bit); DDRC |= _BV(bit); } while (0)
+#define IIC_PIN_RELEASE(bit)    do { DDRC &= ~_BV(bit); PORTC |= _BV(bit); } while (0)
+
+//
+// transfer phases
+
+#define IIC_PHASE_WRITE     0
+#define IIC_PHASE_READ      1
+
+namespace Kernel
+{
+
+    //
+    // an SCL frequency, as the TWI sets it: F_CPU/(16+2*Twbr*4^Twps)
+
+    typedef struct IICRATE {
+        uint8_t     Twbr;
+        uint8_t     Twps;                   // prescaler bits, TWSR 1:0
+    } IICRATE;
+
+    //
+    // driver internals: the transfer queue, where the engine is in the
+    // transfer at its head, and the bus speeds. Zero-initialised, with no
+    // constructor, so device drivers may set their speeds from their own
+    // constructors whatever the order of static construction.
+
+    typedef class IICINTERNALS * PIICINTERNALS;
+    class IICINTERNALS {
+        public:
+            volatile PIICXFER   pHead;      // transfer on the bus
+            PIICXFER            pTail;
+            unsigned int        Index;      // next byte of the current phase (of the segment)
+            uint8_t             Seg;        // segment being written, gathered writes
+            unsigned int        Sent;       // bytes written
+            uint8_t             Phase;      // IIC_PHASE_
+            boolean             Live;       // the START is out
+            unsigned long       Started;    // kernel clock when the START was requested
+            unsigned long       Waiting;    // kernel clock since when the engine has waited on the TWI
+            unsigned long       Timeout;    // microseconds allowed from Waiting
+            IICERRSTATS         Stats;
+#if IIC_STATS
+            unsigned long       LiveAt;     // kernel clock when the START went out
+            uint8_t             nAddrs;
+            IICADDRSTATS        Addrs[IIC_MAX_STAT_ADDRS];
+            uint8_t             UtilSlot;   // slot now filling
+            unsigned long       UtilSlotStart;
+            unsigned long       UtilBusy[IIC_UTIL_SLOTS];   // bus time ended in each slot
+#endif
+            uint8_t             nDevices;
+            IICRATE             Default;
+            unsigned char       DevAddr[IIC_MAX_DEVICES];
+            IICRATE             DevRate[IIC_MAX_DEVICES];
+    };
+
+    static IICINTERNALS iicInternals;
+
+    KERNEL_RAM(IIC,sizeof(iicInternals));
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// RateFor
+    ///
+    /// Work out TWBR and the prescaler for the fastest SCL not above hz
+    ///
+    /// @scope: INTERNAL
+    /// @context: ANY
+    /// @param: hz - unsigned long. Requested SCL frequency
+    /// @return: IICRATE. Register settings
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static IICRATE RateFor(unsigned long hz)
+    {
+        IICRATE rate = {255, 3};            // slowest possible
+        unsigned long div;
+
+        if (hz > IIC_MAX_HZ)
+        {
+            hz = IIC_MAX_HZ;
+        }
+        if (hz)
+        {
+            // Twbr*4^Twps, rounded up so SCL never exceeds hz
+            div = (F_CPU + hz - 1) / hz;
+            div = (div > 16) ? (div - 15) / 2 : 0;
+            for (uint8_t twps = 0; twps < 4; twps++)
+            {
+                unsigned long twbr = (div + (1UL << (2 * twps)) - 1) >> (2 * twps);
+                if (twbr <= 255)
+                {
+                    rate.Twbr = twbr;
+                    rate.Twps = twps;
+                    break;
+                }
+            }
+        }
+        return rate;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// RateHz
+    ///
+    /// SCL frequency given by a rate
+    ///
+    /// @scope: INTERNAL
+    /// @context: ANY
+    /// @param: rate - IICRATE. Register settings
+    /// @return: unsigned long. SCL frequency
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static unsigned long RateHz(IICRATE rate)
+    {
+        return F_CPU / (16 + 2 * ((unsigned long)rate.Twbr << (2 * rate.Twps)));
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// RateOf
+    ///
+    /// The rate for transfers to an address
+    ///
+    /// @scope: INTERNAL
+    /// @context: ANY
+    /// @param: addr - unsigned char. Address. Top 7 bits used
+    /// @return: IICRATE. Register settings
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static IICRATE RateOf(unsigned char addr)
+    {
+        for (uint8_t idx = 0; idx < iicInternals.nDevices; idx++)
+        {
+            if (iicInternals.DevAddr[idx] == (addr & 0xfe))
+            {
+                return iicInternals.DevRate[idx];
+            }
+        }
+        return iicInternals.Default;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// SetRate
+    ///
+    /// Program the TWI bit rate. Only while SCL is held (TWINT set) or the bus
+    /// is idle.
+    ///
+    /// @scope: INTERNAL
+    /// @context: ANY
+    /// @param: rate - IICRATE. Register settings
+    /// @return: NONE
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static void SetRate(IICRATE rate)
+    {
+        TWBR = rate.Twbr;
+        TWSR = rate.Twps;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// Begin
+    ///
+    /// Set the engine up for the transfer now at the head of the queue. The
+    /// caller sends the START.
+    ///
+    /// @scope: INTERNAL
+    /// @context: ANY, engine not running
+    /// @param: xfer - PIICXFER. Transfer at the head of the queue
+    /// @return: NONE
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static void Begin(PIICXFER xfer)
+    {
+        unsigned long hz = RateHz(RateOf(xfer->Addr));
+        unsigned int nTx = xfer->nTx;
+        unsigned long bits;
+
+        if (xfer->nTxSegs)
+        {
+            nTx = 0;
+            for (uint8_t seg = 0; seg < xfer->nTxSegs; seg++)
+            {
+                nTx += xfer->pTxSegs[seg].Len;
+            }
+        }
+        bits = 9UL * (nTx + xfer->nRx + 2);                         // with both address bytes
+
+        iicInternals.Index = 0;
+        iicInternals.Seg = 0;
+        iicInternals.Sent = 0;
+        iicInternals.Phase = (nTx || !xfer->nRx) ? IIC_PHASE_WRITE : IIC_PHASE_READ;
+        iicInternals.Live = false;
+        iicInternals.Started = TimerService::Now();
+        iicInternals.Waiting = iicInternals.Started;
+        iicInternals.Timeout = (xfer->TimeoutUs) ? xfer->TimeoutUs : (2 * bits * ((1000000UL + hz - 1) / hz) + IIC_TIMEOUT_US);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// Recover
+    ///
+    /// Free a stuck bus and restart the TWI: clock SCL until the slave holding
+    /// SDA low lets it go (at most 9 pulses, the most it can be part way
+    /// through), then send a STOP by hand
+    ///
+    /// @scope: INTERNAL
+    /// @context: ANY, engine not running
+    /// @param: NONE
+    /// @return: NONE
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static void Recover(void)
+    {
+        TWCR = 0;                       // TWI off: the pins are ours
+        IIC_PIN_RELEASE(IIC_SDA);
+        IIC_PIN_RELEASE(IIC_SCL);
+        delayMicroseconds(IIC_RECOVER_HALF_US);
+
+        for (uint8_t clk = 0; (clk < 9) && !(PINC & _BV(IIC_SDA)); clk++)
+        {
+            IIC_PIN_LOW(IIC_SCL);
+            delayMicroseconds(IIC_RECOVER_HALF_US);
+            IIC_PIN_RELEASE(IIC_SCL);
+            delayMicroseconds(IIC_RECOVER_HALF_US);
+        }
+
+        // STOP: SDA rises while SCL is high
+        IIC_PIN_LOW(IIC_SCL);
+        IIC_PIN_LOW(IIC_SDA);
+        delayMicroseconds(IIC_RECOVER_HALF_US);
+        IIC_PIN_RELEASE(IIC_SCL);
+        delayMicroseconds(IIC_RECOVER_HALF_US);
+        IIC_PIN_RELEASE(IIC_SDA);
+        delayMicroseconds(IIC_RECOVER_HALF_US);
+
+        TWCR = _BV(TWEN);
+        iicInternals.Stats.Recoveries++;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// WaitStop
+    ///
+    /// Wait for a STOP to go out, recovering the bus if it does not. The wait
+    /// is counted in microsecond delays, not on the kernel clock, which stands
+    /// still when interrupts are off
+    ///
+    /// @scope: INTERNAL
+    /// @context: ANY, engine not running
+    /// @param: NONE
+    /// @return: NONE
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static void WaitStop(void)
+    {
+        for (unsigned int waited = 0; TWCR & _BV(TWSTO); waited++)
+        {
+            if (waited >= IIC_STOP_TIMEOUT_US)
+            {
+                Recover();
+                break;
+            }
+            delayMicroseconds(1);
+        }
+    }
+
+#if IIC_STATS
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// UtilAdvance
+    ///
+    /// Move the utilisation window on to the slot holding now
+    ///
+    /// @scope: INTERNAL
+    /// @context: ANY, interrupts disabled
+    /// @param: now - unsigned long. Kernel clock
+    /// @return: NONE
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static void UtilAdvance(unsigned long now)
+    {
+        for (uint8_t n = 0; (n < IIC_UTIL_SLOTS) && ((now - iicInternals.UtilSlotStart) >= IIC_UTIL_SLOT_MS * 1000UL); n++)
+        {
+            iicInternals.UtilSlot = (iicInternals.UtilSlot + 1) % IIC_UTIL_SLOTS;
+            iicInternals.UtilBusy[iicInternals.UtilSlot] = 0;
+            iicInternals.UtilSlotStart += IIC_UTIL_SLOT_MS * 1000UL;
+        }
+
+        // idle for the whole window: start it again from now
+        if ((now - iicInternals.UtilSlotStart) >= IIC_UTIL_SLOT_MS * 1000UL)
+        {
+            iicInternals.UtilSlotStart = now;
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// Account
+    ///
+    /// Add the transfer at the head of the queue, now ending, to its address's
+    /// statistics and to the bus utilisation
+    ///
+    /// @scope: INTERNAL
+    /// @context: as Finish
+    /// @param: status - int8_t. Final status
+    /// @param: now - unsigned long. Kernel clock
+    /// @return: NONE
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static void Account(int8_t status, unsigned long now)
+    {
+        PIICXFER xfer = iicInternals.pHead;
+        PIICADDRSTATS stats = NULL;
+        unsigned long busy = (iicInternals.Live) ? (now - iicInternals.LiveAt) : 0;
+        uint8_t idx;
+
+        for (idx = 0; (idx < iicInternals.nAddrs) && (iicInternals.Addrs[idx].Addr != (xfer->Addr & 0xfe)); idx++)
+            ;
+        if (idx < iicInternals.nAddrs)
+        {
+            stats = &iicInternals.Addrs[idx];
+        }
+        else if (idx < IIC_MAX_STAT_ADDRS)
+        {
+            stats = &iicInternals.Addrs[iicInternals.nAddrs++];
+            memset(stats, 0, sizeof(IICADDRSTATS));                 // may be left over from before ResetStats
+            stats->Addr = xfer->Addr & 0xfe;
+        }
+
+        if (stats)
+        {
+            stats->Transfers++;
+            stats->TxBytes += iicInternals.Sent;
+            stats->RxBytes += (iicInternals.Phase == IIC_PHASE_READ) ? iicInternals.Index : 0;
+            stats->Nacks += (status == IIC_ERR_NACK || status == IIC_ERR_DATA) ? 1 : 0;
+            stats->ArbLost += (status == IIC_ERR_ARB) ? 1 : 0;
+            stats->BusUs += busy;
+        }
+
+        UtilAdvance(now);
+        iicInternals.UtilBusy[iicInternals.UtilSlot] += busy;
+    }
+
+#endif
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// Finish
+    ///
+    /// Complete the transfer at the head of the queue: end it on the bus, start
+    /// the next one, and report the result.
+    ///
+    /// @scope: INTERNAL
+    /// @context: as Step
+    /// @param: status - int8_t. Final status
+    /// @param: end - uint8_t. IIC_END_ code: how to leave the bus
+    /// @return: NONE
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static void Finish(int8_t status, uint8_t end)
+    {
+        PIICXFER xfer = iicInternals.pHead;
+        unsigned long now = TimerService::Now();
+        unsigned long took = now - iicInternals.Started;
+
+#if IIC_STATS
+        Account(status, now);
+#endif
+        if (took > iicInternals.Stats.WorstUs)
+        {
+            iicInternals.Stats.WorstUs = took;
+        }
+        if (status != IIC_OK)
+        {
+            iicInternals.Stats.Errors[-1 - status]++;
+        }
+        if (end == IIC_END_RESET)
+        {
+            Recover();
+        }
+
+        iicInternals.pHead = xfer->pNext;
+        if (iicInternals.pHead)
+        {
+            // STOP then START for the next transfer, without waiting here,
+            // at the slower of the two devices' speeds. The next device's own
+            // speed is set once the START is out.
+            IICRATE next = RateOf(iicInternals.pHead->Addr);
+            if (((unsigned int)next.Twbr << (2 * next.Twps)) > ((unsigned int)TWBR << (2 * (TWSR & 0x03))))
+            {
+                SetRate(next);
+            }
+            Begin(iicInternals.pHead);
+            TWCR = IIC_TWCR_GO | _BV(TWSTA) | ((end == IIC_END_STOP) ? _BV(TWSTO) : 0);
+        }
+        else
+        {
+            iicInternals.pTail = NULL;
+            if (end != IIC_END_RESET)
+            {
+                TWCR = (end == IIC_END_STOP) ? IIC_TWCR_STOP : (_BV(TWINT) | _BV(TWEN));
+            }
+        }
+
+        xfer->pNext = NULL;
+        xfer->Status = status;
+        if (xfer->Callback)
+        {
+            xfer->Callback(xfer, xfer->Context);
+        }
+        if (xfer->MsgId != IIC_NO_MSG)
+        {
+            MQClass::Get().Post(xfer->MsgId, xfer, MQ_OWNER_CALLER, IIC_MQ_CONTEXT);
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// NextTx
+    ///
+    /// Fetch the next byte to write, from pTx or from the segments
+    ///
+    /// @scope: INTERNAL
+    /// @context: as Step
+    /// @param: xfer - PIICXFER. Transfer on the bus
+    /// @param: data - uint8_t * Receives the byte
+    /// @return: boolean. false if every byte has been written
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static boolean NextTx(PIICXFER xfer, uint8_t * data)
+    {
+        if (xfer->nTxSegs)
+        {
+            while ((iicInternals.Seg < xfer->nTxSegs) && (iicInternals.Index >= xfer->pTxSegs[iicInternals.Seg].Len))
+            {
+                iicInternals.Seg++;
+                iicInternals.Index = 0;
+            }
+            if (iicInternals.Seg >= xfer->nTxSegs)
+            {
+                return false;
+            }
+            *data = ((const uint8_t *)xfer->pTxSegs[iicInternals.Seg].pData)[iicInternals.Index++];
+        }
+        else
+        {
+            if (iicInternals.Index >= xfer->nTx)
+            {
+                return false;
+            }
+            *data = xfer->pTx[iicInternals.Index++];
+        }
+        iicInternals.Sent++;
+        return true;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// Step
+    ///
+    /// Handle one bus event for the transfer at the head of the queue. TWINT
+    /// is set.
+    ///
+    /// @scope: INTERNAL
+    /// @context: INTERRUPT with IIC_INTERRUPT, otherwise TASK (from Poll)
+    /// @param: NONE
+    /// @return: NONE
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static void Step(void)
+    {
+        PIICXFER xfer = iicInternals.pHead;
+        uint8_t data;
+
+        if (!xfer)
+        {
+            return;
+        }
+
+        switch (TWSR & 0xf8)
+        {
+            case 0x08: // START sent: SCL is held, so switch to the device's speed
+                iicInternals.Live = true;
+#if IIC_STATS
+                iicInternals.LiveAt = TimerService::Now();
+#endif
+                SetRate(RateOf(xfer->Addr));
+                // fall through
+            case 0x10: // repeated START sent
+                TWDR = (iicInternals.Phase == IIC_PHASE_WRITE) ? (xfer->Addr & 0xfe) : (xfer->Addr | 0x01);
+                TWCR = IIC_TWCR_GO;
+                break;
+
+            case 0x18: // SLA+W acknowledged
+            case 0x28: // data byte acknowledged
+                if (NextTx(xfer, &data))
+                {
+                    TWDR = data;
+                    TWCR = IIC_TWCR_GO;
+                }
+                else if (xfer->nRx)
+                {
+                    // read half: repeated START, so the bus is held from
+                    // the write through to the read
+                    iicInternals.Index = 0;
+                    iicInternals.Phase = IIC_PHASE_READ;
+                    TWCR = IIC_TWCR_GO | _BV(TWSTA);
+                }
+                else
+                {
+                    Finish(IIC_OK, IIC_END_STOP);
+                }
+                break;
+
+            case 0x40: // SLA+R acknowledged: ack every byte but the last
+                TWCR = IIC_TWCR_GO | ((xfer->nRx > 1) ? _BV(TWEA) : 0);
+                break;
+
+            case 0x50: // data byte received, ack returned
+                xfer->pRx[iicInternals.Index++] = TWDR;
+                TWCR = IIC_TWCR_GO | ((iicInternals.Index < (xfer->nRx - 1)) ? _BV(TWEA) : 0);
+                break;
+
+            case 0x58: // last data byte received, nack returned
+                xfer->pRx[iicInternals.Index++] = TWDR;
+                Finish(IIC_OK, IIC_END_STOP);
+                break;
+
+            case 0x20: // SLA+W not acknowledged
+            case 0x48: // SLA+R not acknowledged
+                Finish(IIC_ERR_NACK, IIC_END_STOP);
+                break;
+
+            case 0x30: // data byte not acknowledged
+                Finish(IIC_ERR_DATA, IIC_END_STOP);
+                break;
+
+            case 0x38: // arbitration lost
+                Finish(IIC_ERR_ARB, IIC_END_RELEASE);
+                break;
+
+            default: // bus error
+                Finish(IIC_ERR_BUS, IIC_END_RESET);
+                break;
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// CheckTimeout
+    ///
+    /// End the transfer at the head of the queue, and recover the bus, if it
+    /// has run out of time. Time runs from when the engine last gave the TWI
+    /// work: from the START with the TWI interrupt, and from the last bus event
+    /// handled when polled, so a loop() pass that comes round late is not
+    /// taken for a stuck bus
+    ///
+    /// @scope: INTERNAL
+    /// @context: as Step, or TASK with interrupts disabled
+    /// @param: NONE
+    /// @return: NONE
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static void CheckTimeout(void)
+    {
+        if (iicInternals.pHead && ((TimerService::Now() - iicInternals.Waiting) > iicInternals.Timeout))
+        {
+            Finish((iicInternals.Live) ? IIC_ERR_TIMEOUT : IIC_ERR_START, IIC_END_RESET);
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// IIC
+    ///
+    /// Initialize the IIC subsystem
+    ///
+    /// @scope: EXPORTED
+    /// @context: TASK
+    /// @param: NONE
+    /// @return: NONE
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    IIC::IIC()
+    {
+        SetSpeed(IIC_DEFAULT_HZ);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// Get
+    ///
+    /// Obtain the singleton class instance
+    ///
+    /// @scope: PUBLIC
+    /// @context: ANY
+    /// @param: none
+    /// @return: reference to singleton class
+    ///
+    //////////////////////////////////////////////////////////////////////////////
+
+    static IIC &IIC::Get(void)
+    {
+        static IIC iic;
+        return iic;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// Submit
+    ///
+    /// Queue a transfer, starting it if the bus is free
+    ///
+    /// @scope: EXPORTED
+    /// @context: TASK, or a completion callback
+    /// @param: xfer - PIICXFER. Descriptor
+    /// @return: int. Zero if queued, nonzero if the descriptor is already
+    ///          queued
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    int IIC::Submit(PIICXFER xfer)
+    {
+        int rc = -1;
+
+        // the STOP ending the last transfer takes about one SCL period to go
+        // out: wait for it here, so it is only checked again below
+        if (!iicInternals.pHead)
+        {
+            WaitStop();
+        }
+
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            if (xfer->Status != IIC_PENDING)
+            {
+                xfer->pNext = NULL;
+                xfer->Status = IIC_PENDING;
+                if (iicInternals.pHead)
+                {
+                    iicInternals.pTail->pNext = xfer;
+                    iicInternals.pTail = xfer;
+                }
+                else
+                {
+                    iicInternals.pHead = iicInternals.pTail = xfer;
+                    WaitStop();
+                    Begin(xfer);
+                    TWCR = IIC_TWCR_GO | _BV(TWSTA);
+                }
+                rc = 0;
+            }
+        }
+        return rc;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// Wait
+    ///
+    /// Wait for a submitted transfer to complete
+    ///
+    /// @scope: EXPORTED
+    /// @context: TASK
+    /// @param: xfer - PIICXFER. Submitted descriptor
+    /// @return: int. Final status
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
 
-namespace Kernel
-{
+    int IIC::Wait(PIICXFER xfer)
+    {
+        while (xfer->Status == IIC_PENDING)
+        {
+            Poll();
+        }
+        return xfer->Status;
+    }
 
     ///////////////////////////////////////////////////////////////////////////////
-    /// IIC
+    /// Flush
     ///
-    /// Initialize the IIC subsystem
+    /// Wait until every queued transfer is complete
     ///
     /// @scope: EXPORTED
     /// @context: TASK
-    /// @param: NONE
-    /// @return: NONE
+    /// @param: none
+    /// @return: none
     ///
     ///////////////////////////////////////////////////////////////////////////////
 
-    IIC::IIC()
+    void IIC::Flush(void)
     {
-        // TWBR=20;		// set bit rate and prescaler
-        TWBR = 80;
-        TWSR = 0x10;
+        while (iicInternals.pHead)
+        {
+            Poll();
+        }
+
+        // leave the bus at the default speed for the Wire library, once the
+        // last STOP is out
+        WaitStop();
+        SetRate(iicInternals.Default);
     }
 
     ///////////////////////////////////////////////////////////////////////////////
-    /// Get
+    /// Poll
     ///
-    /// Obtain the singleton class instance
+    /// Advance the transfer engine through the bus events that come within
+    /// IIC_POLL_SLICE_US, or by one if the slice is 0
     ///
-    /// @scope: PUBLIC
-    /// @context: ANY
+    /// @scope: EXPORTED
+    /// @context: TASK
     /// @param: none
-    /// @return: reference to singleton class
+    /// @return: boolean. true if a transfer still needs polling
     ///
-    //////////////////////////////////////////////////////////////////////////////
+    ///////////////////////////////////////////////////////////////////////////////
 
-    static IIC &IIC::Get(void)
+    boolean IIC::Poll(void)
     {
-        static IIC iic;
-        return iic;
+#if IIC_INTERRUPT
+        // the TWI interrupt runs the engine: only the timeout is checked here
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            CheckTimeout();
+        }
+        return false;
+#else
+        unsigned long start = TimerService::Now();
+
+        while (iicInternals.pHead)
+        {
+            if (TWCR & _BV(TWINT))
+            {
+                Step();
+                iicInternals.Waiting = TimerService::Now();
+            }
+            if ((TimerService::Now() - start) >= IIC_POLL_SLICE_US)
+            {
+                break;
+            }
+        }
+        CheckTimeout();
+        return (iicInternals.pHead != NULL);
+#endif
     }
 
     ///////////////////////////////////////////////////////////////////////////////
     /// IICWrite
     ///
-    /// Write a single byte of data to the IIC address
+    /// Write multiple bytes of data to the IIC address, and wait for the
+    /// transfer to complete
     ///
     /// @scope: EXPORTED
     /// @context: TASK
     /// @param: addr - unsigned char. Address. Top 7 bits used
-    /// @param: dbyte - unsigned char. Data to send
+    /// @param: dbytes - unsigned char * Data to send
+    /// @param: nToSend - number of bytes to send
+    /// @return: int. IIC_OK, or an IIC_ERR_ code
     ///
     ///////////////////////////////////////////////////////////////////////////////
 
     int IIC::IICWrite(unsigned char addr, unsigned char *dbytes, unsigned int nToSend)
     {
-        int rc = 0;
-        // This is out of the data sheet!
-        // Polled I2C write transfer
-
-        TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTA); // send start bit
-
-        while (!(TWCR & (1 << TWINT)))
-            ; // wait for ack
-        if (TWSR & 0x08)
-        { // start bit set
-            // send the address, with W bit set to zero
-            TWDR = addr & 0xfe;                // load address
-            TWCR = (1 << TWINT) | (1 << TWEN); // whang it in
-            while (!(TWCR & (1 << TWINT)))
-                ; // wait for complete
-            if ((TWSR & 0xf8) == 0x18)
-            { // check addr ack received
-                for (int idx = 0; (idx < nToSend); idx++)
+        IICXFER xfer = {NULL, addr, dbytes, nToSend, NULL, 0, NULL, 0, NULL, NULL, IIC_NO_MSG, 0, IIC_OK};
+
+        Submit(&xfer);
+        return Wait(&xfer);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// IICRead
+    ///
+    /// Read multiple bytes of data from the IIC address, and wait for the
+    /// transfer to complete
+    ///
+    /// @scope: EXPORTED
+    /// @context: TASK
+    /// @param: addr - unsigned char. Address. Top 7 bits used
+    /// @param: dbytes - unsigned char * Pointer to buffer big enough to receive
+    ///                  data
+    /// @param: nToRecv - number of bytes to receive
+    /// @return: int. IIC_OK, or an IIC_ERR_ code
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    int IIC::IICRead(unsigned char addr, unsigned char *dbytes, unsigned int nToRecv)
+    {
+        IICXFER xfer = {NULL, addr, NULL, 0, NULL, 0, dbytes, nToRecv, NULL, NULL, IIC_NO_MSG, 0, IIC_OK};
+
+        Submit(&xfer);
+        return Wait(&xfer);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// WriteRead
+    ///
+    /// Write bytes to the IIC address then, after a repeated START, read bytes
+    /// back from it, and wait for the transfer to complete
+    ///
+    /// @scope: EXPORTED
+    /// @context: TASK
+    /// @param: addr - unsigned char. Address. Top 7 bits used
+    /// @param: tx - const unsigned char * Data to send, usually a register or
+    ///              memory address
+    /// @param: nToSend - number of bytes to send
+    /// @param: rx - unsigned char * Pointer to buffer big enough to receive
+    ///              data
+    /// @param: nToRecv - number of bytes to receive
+    /// @return: int. IIC_OK, or an IIC_ERR_ code
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    int IIC::WriteRead(unsigned char addr, const unsigned char *tx, unsigned int nToSend, unsigned char *rx, unsigned int nToRecv)
+    {
+        IICXFER xfer = {NULL, addr, tx, nToSend, NULL, 0, rx, nToRecv, NULL, NULL, IIC_NO_MSG, 0, IIC_OK};
+
+        Submit(&xfer);
+        return Wait(&xfer);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// WriteV
+    ///
+    /// Write several buffers to the IIC address as one transfer and wait for it
+    /// to complete. The bytes go on the bus straight from each buffer in turn
+    ///
+    /// @scope: EXPORTED
+    /// @context: TASK
+    /// @param: addr - unsigned char. Address. Top 7 bits used
+    /// @param: segs - const IICSEG * The buffers, in order
+    /// @param: nSegs - number of segments
+    /// @return: int. IIC_OK, or an IIC_ERR_ code
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    int IIC::WriteV(unsigned char addr, const IICSEG *segs, uint8_t nSegs)
+    {
+        IICXFER xfer = {NULL, addr, NULL, 0, segs, nSegs, NULL, 0, NULL, NULL, IIC_NO_MSG, 0, IIC_OK};
+
+        Submit(&xfer);
+        return Wait(&xfer);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// SetSpeed
+    ///
+    /// Set the default SCL frequency
+    ///
+    /// @scope: EXPORTED
+    /// @context: TASK
+    /// @param: hz - unsigned long. Requested SCL frequency
+    /// @return: unsigned long. The SCL frequency achieved
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    unsigned long IIC::SetSpeed(unsigned long hz)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            iicInternals.Default = RateFor(hz);
+            if (!iicInternals.pHead)
+            {
+                SetRate(iicInternals.Default);
+            }
+        }
+        return RateHz(iicInternals.Default);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// SetDeviceSpeed
+    ///
+    /// Set the SCL frequency for transfers to one device
+    ///
+    /// @scope: EXPORTED
+    /// @context: TASK
+    /// @param: addr - unsigned char. Address. Top 7 bits used
+    /// @param: hz - unsigned long. Requested SCL frequency
+    /// @return: unsigned long. The SCL frequency achieved, zero if the device
+    ///          table is full
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    unsigned long IIC::SetDeviceSpeed(unsigned char addr, unsigned long hz)
+    {
+        IICRATE rate = RateFor(hz);
+        unsigned long rc = 0;
+        uint8_t idx;
+
+        addr &= 0xfe;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            for (idx = 0; (idx < iicInternals.nDevices) && (iicInternals.DevAddr[idx] != addr); idx++)
+                ;
+            if (idx < IIC_MAX_DEVICES)
+            {
+                iicInternals.DevAddr[idx] = addr;
+                iicInternals.DevRate[idx] = rate;
+                if (idx == iicInternals.nDevices)
                 {
-                    TWDR = *(dbytes + idx);            // load byte
-                    TWCR = (1 << TWINT) | (1 << TWEN); // whang it in
-                    while (!(TWCR & (1 << TWINT)))
-                        ; // wait for complete
-                    if ((TWSR & 0xf8) != 0x28)
-                    { // check for data ack received
-                        rc = -2;
-                        break;
-                    }
+                    iicInternals.nDevices++;
                 }
+                rc = RateHz(rate);
             }
-            else
+        }
+        return rc;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// GetSpeed
+    ///
+    /// The SCL frequency used for transfers to a device
+    ///
+    /// @scope: EXPORTED
+    /// @context: ANY
+    /// @param: addr - unsigned char. Address. Top 7 bits used
+    /// @return: unsigned long. SCL frequency
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    unsigned long IIC::GetSpeed(unsigned char addr)
+    {
+        return RateHz(RateOf(addr));
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// Benchmark
+    ///
+    /// Measure the read throughput achieved from a device
+    ///
+    /// @scope: EXPORTED
+    /// @context: TASK
+    /// @param: addr - unsigned char. Address. Top 7 bits used
+    /// @param: buf - unsigned char * Scratch buffer of len bytes
+    /// @param: len - bytes per transfer
+    /// @param: passes - number of transfers
+    /// @return: unsigned long. Bytes per second, zero if a transfer failed
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    unsigned long IIC::Benchmark(unsigned char addr, unsigned char *buf, unsigned int len, unsigned int passes)
+    {
+        unsigned long bytes = (unsigned long)len * passes;
+        unsigned long start = TimerService::Now();
+        unsigned long elapsed;
+
+        for (unsigned int pass = 0; pass < passes; pass++)
+        {
+            if (IICRead(addr, buf, len) != IIC_OK)
             {
-                rc = -2;
+                return 0;
             }
-            TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO); // send stop bit
-            while (TWCR & (1 << TWSTO))
-                ; // wait for it to be cleared
         }
-        else
+        elapsed = TimerService::Now() - start;
+
+        // bytes*1000000/elapsed, scaled down to stay within 32 bits
+        while (bytes > 4294UL)
         {
-            rc = -1;
+            bytes >>= 1;
+            elapsed >>= 1;
         }
-        return rc;
+        return (elapsed) ? (bytes * 1000000UL) / elapsed : 0;
     }
 
     ///////////////////////////////////////////////////////////////////////////////
-    /// IICRead
+    /// GetErrorStats
     ///
-    /// Wread multiple bytes of data from the IIC address
+    /// Read the failure counters and the longest transfer time
     ///
     /// @scope: EXPORTED
-    /// @context: TASK
+    /// @context: ANY
+    /// @param: stats - PIICERRSTATS. Filled in
+    /// @return: NONE
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    void IIC::GetErrorStats(PIICERRSTATS stats)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            *stats = iicInternals.Stats;
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// ResetErrorStats
+    ///
+    /// Zero the failure counters and the longest transfer time
+    ///
+    /// @scope: EXPORTED
+    /// @context: ANY
+    /// @param: NONE
+    /// @return: NONE
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    void IIC::ResetErrorStats(void)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            memset(&iicInternals.Stats, 0, sizeof(iicInternals.Stats));
+        }
+    }
+
+#if IIC_STATS
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// GetAddrStats
+    ///
+    /// Read the traffic statistics for one address
+    ///
+    /// @scope: EXPORTED
+    /// @context: ANY
     /// @param: addr - unsigned char. Address. Top 7 bits used
-    /// @param: dbytes - unsigned char * Pointer to buffer big enough to receive
-    ///                  data
-    /// @param: nToRecv - number of bytes to receive
+    /// @param: stats - PIICADDRSTATS. Filled in
+    /// @return: int. Zero if successful, nonzero if the address has no
+    ///          statistics
     ///
     ///////////////////////////////////////////////////////////////////////////////
 
-    int IIC::IICRead(unsigned char addr, unsigned char *dbytes, unsigned int nToRecv)
+    int IIC::GetAddrStats(unsigned char addr, PIICADDRSTATS stats)
     {
-        int rc = 0;
-        // This is out of the data sheet!
-        // Polled I2C read transfer
-
-        TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTA); // send start bit
-        while (!(TWCR & (1 << TWINT)))
-            ; // wait for ack
-        if (TWSR & 0x08)
-        { // start bit set
-            // send the address, with W bit set to 1
-            TWDR = addr | 0x01;                // load address
-            TWCR = (1 << TWINT) | (1 << TWEN); // whang it in
-            while (!(TWCR & (1 << TWINT)))
-                ; // wait for complete
-            if ((TWSR & 0xf8) == 0x40)
-            { // check addr ack received
-                for (int idx = 0; idx < nToRecv; idx++)
+        int rc = -1;
+
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            for (uint8_t idx = 0; idx < iicInternals.nAddrs; idx++)
+            {
+                if (iicInternals.Addrs[idx].Addr == (addr & 0xfe))
                 {
-                    // check if we need ack before receiving.
-                    TWCR = (idx == (nToRecv - 1)) ? (1 << TWINT) | (1 << TWEN) : (1 << TWINT) | (1 << TWEN) | (1 << TWEA);
-                    while (!(TWCR & (1 << TWINT)))
-                        ; // wait for ready
-                    if (((TWSR & 0xf8) == 0x50) || ((TWSR & 0xf8) == 0x58))
-                    {                           // check for data ack received
-                        *(dbytes + idx) = TWDR; // load byte
-                    }
-                    else
-                    {
-                        rc = -2;
-                        break;
-                    }
+                    *stats = iicInternals.Addrs[idx];
+                    rc = 0;
+                    break;
                 }
             }
-            else
+        }
+        return rc;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// GetBusUtilisation
+    ///
+    /// Share of the sliding window that the driver's transfers held the bus
+    ///
+    /// @scope: EXPORTED
+    /// @context: ANY
+    /// @param: NONE
+    /// @return: uint8_t. Percent
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    uint8_t IIC::GetBusUtilisation(void)
+    {
+        unsigned long busy = 0;
+        unsigned long span;
+
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            unsigned long now = TimerService::Now();
+
+            UtilAdvance(now);
+            for (uint8_t slot = 0; slot < IIC_UTIL_SLOTS; slot++)
             {
-                rc = -2;
+                busy += iicInternals.UtilBusy[slot];
             }
-            TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO); // send stop bit
-            while (TWCR & (1 << TWSTO))
-                ; // wait for it to be cleared
+            span = (IIC_UTIL_SLOTS - 1) * IIC_UTIL_SLOT_MS * 1000UL + (now - iicInternals.UtilSlotStart);
         }
-        else
+        return (busy >= span) ? 100 : (uint8_t)((busy * 100UL) / span);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// ResetStats
+    ///
+    /// Forget the traffic statistics of every address
+    ///
+    /// @scope: EXPORTED
+    /// @context: ANY
+    /// @param: NONE
+    /// @return: NONE
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    void IIC::ResetStats(void)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
         {
-            rc = -1;
+            iicInternals.nAddrs = 0;
         }
-        return rc;
     }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    /// DumpStats
+    ///
+    /// Print the traffic statistics (see iic.h)
+    ///
+    /// @scope: EXPORTED
+    /// @context: TASK
+    /// @param: out - Print &. Where to print (e.g. Serial)
+    /// @return: NONE
+    ///
+    ///////////////////////////////////////////////////////////////////////////////
+
+    void IIC::DumpStats(Print & out)
+    {
+        IICADDRSTATS stats;
+        IICERRSTATS errs;
+
+        for (uint8_t idx = 0; idx < iicInternals.nAddrs; idx++)
+        {
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+            {
+                stats = iicInternals.Addrs[idx];
+            }
+            out.print(F("IIC,"));
+            out.print(stats.Addr, HEX);
+            out.print(',');
+            out.print(stats.Transfers);
+            out.print(',');
+            out.print(stats.TxBytes);
+            out.print(',');
+            out.print(stats.RxBytes);
+            out.print(',');
+            out.print(stats.Nacks);
+            out.print(',');
+            out.print(stats.ArbLost);
+            out.print(',');
+            out.println(stats.BusUs);
+        }
+
+        GetErrorStats(&errs);
+        out.print(F("IICBUS,"));
+        out.print((unsigned int)GetBusUtilisation());
+        out.print(',');
+        out.print(errs.Recoveries);
+        out.print(',');
+        out.println(errs.WorstUs);
+    }
+
+#endif
+}
+
+#if IIC_INTERRUPT
+
+///////////////////////////////////////////////////////////////////////////////
+/// TWI interrupt
+///
+/// Drives the transfer engine
+///
+///////////////////////////////////////////////////////////////////////////////
+
+ISR(TWI_vect)
+{
+    Kernel::Step();
 }
+
+#endif
@@ -3,6 +3,13 @@
 ///
 /// IIC peripheral driver for ATMega328p
 ///
+/// Transfers are described by IICXFER descriptors and queued with Submit. A
+/// transfer engine, driven by the TWI interrupt or polled from the kernel
+/// loop, works through the queue one bus event at a time, so a task that
+/// submits a transfer carries on while it is on the bus and is told of
+/// completion by a callback, a message, or by checking the descriptor.
+/// IICWrite and IICRead submit a transfer and wait for it.
+///
 /// Dr J A Gow 2022
 ///
 ///////////////////////////////////////////////////////////////////////////////
@@ -10,12 +17,178 @@
 #ifndef _IIC_H_
 #define _IIC_H_
 
-///
-/// IIC reconstructed as a class. This will be a singleton class that allows
-/// access to IIC functions
+#include "sysincs.h"
+
+//
+// Set IIC_INTERRUPT to 1 to run the transfer engine from the TWI interrupt.
+// The Arduino Wire library, which LiquidCrystal_I2C uses for the display,
+// defines TWI_vect as well, so this is off by default: the kernel loop then
+// polls the engine, handling the bus events that fall within IIC_POLL_SLICE_US
+// on each pass of loop(), and does not idle-sleep while a transfer is on the
+// bus. At 400kHz a byte takes about 23us, so the default slice moves around
+// eight bytes a pass; set it to 0 for one bus event a pass.
+
+#ifndef IIC_INTERRUPT
+#define IIC_INTERRUPT		0
+#endif
+
+#ifndef IIC_POLL_SLICE_US
+#define IIC_POLL_SLICE_US	200UL
+#endif
+
+//
+// Bus speed. SCL runs at IIC_DEFAULT_HZ except while a transfer is on the bus
+// to a device given its own speed with SetDeviceSpeed, for up to
+// IIC_MAX_DEVICES devices. Requests are capped at IIC_MAX_HZ, the fastest
+// the ATmega328p TWI is specified for.
+
+#ifndef IIC_DEFAULT_HZ
+#define IIC_DEFAULT_HZ		100000UL
+#endif
+
+#ifndef IIC_MAX_HZ
+#define IIC_MAX_HZ			400000UL
+#endif
+
+#ifndef IIC_MAX_DEVICES
+#define IIC_MAX_DEVICES		4
+#endif
+
+//
+// Timeouts, on the kernel clock. A transfer is given twice its time on the
+// wire at its SCL speed plus IIC_TIMEOUT_US (for clock stretching and the wait
+// for a free bus), unless its descriptor sets TimeoutUs. A transfer that runs
+// out of time, or meets a bus error, is ended and the bus recovered: up to 9
+// SCL pulses to free a slave holding SDA low, a STOP, and the TWI restarted.
+// So no transfer holds the bus for longer than its timeout and the recovery
+// (about 100us), and Wait never blocks for longer than the transfers ahead.
+// Polled (without IIC_INTERRUPT) the timeout runs from the last bus event
+// the engine handled rather than from the START: the TWI waits, holding SCL,
+// while loop() is elsewhere, and that wait is not the bus's fault.
+
+#ifndef IIC_TIMEOUT_US
+#define IIC_TIMEOUT_US		2000UL
+#endif
+
+#ifndef IIC_STOP_TIMEOUT_US
+#define IIC_STOP_TIMEOUT_US	1000UL			// for a STOP to go out
+#endif
+
+#ifndef IIC_RECOVER_HALF_US
+#define IIC_RECOVER_HALF_US	5				// half an SCL period during recovery
+#endif
+
+//
+// Set IIC_STATS to 0 to leave out the traffic statistics (see GetAddrStats
+// and GetBusUtilisation). They are kept for the first IIC_MAX_STAT_ADDRS
+// addresses used, at 21 bytes of RAM each. Utilisation is the share of the
+// last IIC_UTIL_SLOTS*IIC_UTIL_SLOT_MS milliseconds (a sliding window, moved
+// on a slot at a time) that the driver's transfers held the bus. Traffic the
+// Wire library sends itself (the LCD) is not seen by the driver.
+
+#ifndef IIC_STATS
+#define IIC_STATS			1
+#endif
+
+#ifndef IIC_MAX_STAT_ADDRS
+#define IIC_MAX_STAT_ADDRS	4
+#endif
+
+#ifndef IIC_UTIL_SLOTS
+#define IIC_UTIL_SLOTS		4
+#endif
+
+#ifndef IIC_UTIL_SLOT_MS
+#define IIC_UTIL_SLOT_MS	250UL
+#endif
+
+//
+// transfer status (IICXFER.Status, and the return of Wait, IICWrite and
+// IICRead)
+
+#define IIC_OK				0		// complete
+#define IIC_PENDING			1		// queued or on the bus
+#define IIC_ERR_START		-1		// the bus was not free for the START in time
+#define IIC_ERR_NACK		-2		// address not acknowledged: no device, or busy
+#define IIC_ERR_DATA		-3		// data byte not acknowledged
+#define IIC_ERR_ARB			-4		// arbitration lost to another master
+#define IIC_ERR_BUS			-5		// bus error: START or STOP out of place
+#define IIC_ERR_TIMEOUT		-6		// started, but not complete in time
+
+#define IIC_NUM_ERRORS		6		// IICERRSTATS.Errors[-1-code] counts code
+
+#define IIC_NO_MSG			-1		// IICXFER.MsgId: post nothing on completion
 
 namespace Kernel {
 
+    typedef struct IICXFER * PIICXFER;
+
+    typedef void (*PFNIICCALLBACK)(PIICXFER xfer, void * context);
+
+    //
+    // one segment of a gathered write, see WriteV
+
+    typedef struct IICSEG {
+        const void *            pData;
+        unsigned int            Len;
+    } IICSEG, * PIICSEG;
+
+    //
+    // transaction descriptor. Writes nTx bytes from pTx (or, if nTxSegs is
+    // set, the nTxSegs segments at pTxSegs one after another) then, after a
+    // repeated START, reads nRx bytes into pRx; either may be zero. The
+    // caller owns the descriptor and the buffers, and must leave them in
+    // place until Status is no longer IIC_PENDING. On completion Callback (if
+    // set) is called and MsgId (if not IIC_NO_MSG) is posted with the
+    // descriptor as its context, from interrupt context with IIC_INTERRUPT
+    // and from the kernel loop without.
+
+    typedef struct IICXFER {
+        PIICXFER                pNext;      // queue link, driver use
+        unsigned char           Addr;       // device address, top 7 bits used
+        const unsigned char *   pTx;
+        unsigned int            nTx;
+        const IICSEG *          pTxSegs;    // gathered write, in place of pTx
+        uint8_t                 nTxSegs;
+        unsigned char *         pRx;
+        unsigned int            nRx;
+        PFNIICCALLBACK          Callback;   // NULL for none
+        void *                  Context;    // passed to Callback
+        int                     MsgId;      // IIC_NO_MSG for none
+        unsigned int            TimeoutUs;  // zero for the default
+        volatile int8_t         Status;     // IIC_PENDING until complete
+    } IICXFER;
+
+    //
+    // failure statistics, see GetErrorStats
+
+    typedef struct IICERRSTATS {
+        unsigned int            Errors[IIC_NUM_ERRORS];    // transfers failed, by IIC_ERR_ code
+        unsigned int            Recoveries;                 // bus recoveries
+        unsigned long           WorstUs;                    // longest transfer, from its START request
+    } IICERRSTATS, * PIICERRSTATS;
+
+    #if IIC_STATS
+
+    //
+    // traffic statistics for one address, see GetAddrStats. Counters wrap.
+
+    typedef struct IICADDRSTATS {
+        unsigned char           Addr;       // top 7 bits
+        unsigned long           Transfers;  // transfers ended, successful or not
+        unsigned long           TxBytes;    // data bytes sent
+        unsigned long           RxBytes;    // data bytes received
+        unsigned int            Nacks;      // address or data byte not acknowledged
+        unsigned int            ArbLost;    // arbitration lost
+        unsigned long           BusUs;      // time holding the bus, START to end
+    } IICADDRSTATS, * PIICADDRSTATS;
+
+    #endif
+
+    ///
+    /// IIC reconstructed as a class. This will be a singleton class that allows
+    /// access to IIC functions
+
     class IIC {
 
         public:
@@ -47,16 +220,84 @@ namespace Kernel {
 			///////////////////////////////////////////////////////////////////////////////
 
 			static IIC& Get(void);
-            
+
+            ///////////////////////////////////////////////////////////////////////////////
+            /// Submit
+            ///
+            /// Queue a transfer. It starts at once if the bus is free, otherwise
+            /// when the transfers ahead of it are complete. Status is set to
+            /// IIC_PENDING here.
+            ///
+            /// @scope: PUBLIC
+            /// @context: TASK, or a completion callback
+            /// @param: xfer - PIICXFER. Descriptor, filled in apart from pNext. A
+            ///                new descriptor must not have Status IIC_PENDING
+            ///                (zero-initialise it)
+            /// @return: int. Zero if queued, nonzero if the descriptor is already
+            ///          queued
+            ///
+            ///////////////////////////////////////////////////////////////////////////////
+
+            int Submit(PIICXFER xfer);
+
+            ///////////////////////////////////////////////////////////////////////////////
+            /// Wait
+            ///
+            /// Wait for a submitted transfer to complete. Not to be called from a
+            /// completion callback.
+            ///
+            /// @scope: PUBLIC
+            /// @context: TASK
+            /// @param: xfer - PIICXFER. Submitted descriptor
+            /// @return: int. Final status, IIC_OK or an IIC_ERR_ code
+            ///
+            ///////////////////////////////////////////////////////////////////////////////
+
+            int Wait(PIICXFER xfer);
+
+            ///////////////////////////////////////////////////////////////////////////////
+            /// Flush
+            ///
+            /// Wait until every queued transfer is complete. Code that drives the
+            /// TWI itself (the Wire library) must call this first.
+            ///
+            /// @scope: PUBLIC
+            /// @context: TASK
+            /// @param: none
+            /// @return: none
+            ///
+            ///////////////////////////////////////////////////////////////////////////////
+
+            void Flush(void);
+
+            ///////////////////////////////////////////////////////////////////////////////
+            /// Poll
+            ///
+            /// Advance the transfer engine by one bus event if the TWI is waiting.
+            /// Called by the kernel loop on every pass; does nothing with
+            /// IIC_INTERRUPT.
+            ///
+            /// @scope: PUBLIC
+            /// @context: TASK
+            /// @param: none
+            /// @return: boolean. true if a transfer still needs polling
+            ///
+            ///////////////////////////////////////////////////////////////////////////////
+
+            boolean Poll(void);
+
             ///////////////////////////////////////////////////////////////////////////////
             /// IICWrite
             ///
-            /// Write a single byte of data to the IIC address
+            /// Write multiple bytes of data to the IIC address, and wait for the
+            /// transfer to complete
             ///
-            /// @scope: INTERNAL
+            /// @scope: PUBLIC
             /// @context: TASK
             /// @param: addr - unsigned char. Address. Top 7 bits used
-            /// @param: dbyte - unsigned char. Data to send
+            /// @param: dbytes - unsigned char * Data to send
+            /// @param: nToSend - number of bytes to send
+            /// @return: int. IIC_OK, or an IIC_ERR_ code
             ///
             ///////////////////////////////////////////////////////////////////////////////
 
@@ -65,19 +306,228 @@ namespace Kernel {
             ///////////////////////////////////////////////////////////////////////////////
             /// IICRead
             ///
-            /// Wread multiple bytes of data from the IIC address
+            /// Read multiple bytes of data from the IIC address, and wait for the
+            /// transfer to complete
             ///
-            /// @scope: INTERNAL
+            /// @scope: PUBLIC
             /// @context: TASK
             /// @param: addr - unsigned char. Address. Top 7 bits used
             /// @param: dbytes - unsigned char * Pointer to buffer big enough to receive
             ///                  data
             /// @param: nToRecv - number of bytes to receive
+            /// @return: int. IIC_OK, or an IIC_ERR_ code
             ///
             ///////////////////////////////////////////////////////////////////////////////
 
             int IICRead(unsigned char addr,unsigned char * dbytes, unsigned int nToRecv);
+
+            ///////////////////////////////////////////////////////////////////////////////
+            /// WriteRead
+            ///
+            /// Write bytes to the IIC address then, after a repeated START, read bytes
+            /// back from it, and wait for the transfer to complete. This is the
+            /// register read: the bus is held from the register address through to
+            /// the data, with one START/STOP pair for the whole exchange.
+            ///
+            /// @scope: PUBLIC
+            /// @context: TASK
+            /// @param: addr - unsigned char. Address. Top 7 bits used
+            /// @param: tx - const unsigned char * Data to send, usually a register or
+            ///              memory address
+            /// @param: nToSend - number of bytes to send
+            /// @param: rx - unsigned char * Pointer to buffer big enough to receive
+            ///              data
+            /// @param: nToRecv - number of bytes to receive
+            /// @return: int. IIC_OK, or an IIC_ERR_ code
+            ///
+            ///////////////////////////////////////////////////////////////////////////////
+
+            int WriteRead(unsigned char addr,const unsigned char * tx, unsigned int nToSend, unsigned char * rx, unsigned int nToRecv);
+
+            ///////////////////////////////////////////////////////////////////////////////
+            /// WriteV
+            ///
+            /// Write several buffers to the IIC address as one transfer, one after
+            /// another, and wait for it to complete. A header (a register or
+            /// memory address) and its payload can be sent from where they are,
+            /// with no copy into a staging buffer.
+            ///
+            /// @scope: PUBLIC
+            /// @context: TASK
+            /// @param: addr - unsigned char. Address. Top 7 bits used
+            /// @param: segs - const IICSEG * The buffers, in order. Empty ones are
+            ///                skipped
+            /// @param: nSegs - number of segments
+            /// @return: int. IIC_OK, or an IIC_ERR_ code
+            ///
+            ///////////////////////////////////////////////////////////////////////////////
+
+            int WriteV(unsigned char addr,const IICSEG * segs, uint8_t nSegs);
+
+            ///////////////////////////////////////////////////////////////////////////////
+            /// SetSpeed
+            ///
+            /// Set the default SCL frequency, used for devices without a speed of
+            /// their own and whenever the queue is empty (so by the Wire library
+            /// too). TWBR and the prescaler are chosen for the fastest SCL not above
+            /// hz.
+            ///
+            /// @scope: PUBLIC
+            /// @context: TASK
+            /// @param: hz - unsigned long. Requested SCL frequency
+            /// @return: unsigned long. The SCL frequency achieved
+            ///
+            ///////////////////////////////////////////////////////////////////////////////
+
+            unsigned long SetSpeed(unsigned long hz);
+
+            ///////////////////////////////////////////////////////////////////////////////
+            /// SetDeviceSpeed
+            ///
+            /// Set the SCL frequency for transfers to one device, normally the
+            /// fastest the device supports. The bus is switched to it for each
+            /// transfer to that address; the START and STOP between two transfers
+            /// are sent at the slower of the two speeds.
+            ///
+            /// @scope: PUBLIC
+            /// @context: TASK
+            /// @param: addr - unsigned char. Address. Top 7 bits used
+            /// @param: hz - unsigned long. Requested SCL frequency
+            /// @return: unsigned long. The SCL frequency achieved, zero if
+            ///          IIC_MAX_DEVICES devices already have a speed
+            ///
+            ///////////////////////////////////////////////////////////////////////////////
+
+            unsigned long SetDeviceSpeed(unsigned char addr, unsigned long hz);
+
+            ///////////////////////////////////////////////////////////////////////////////
+            /// GetSpeed
+            ///
+            /// The SCL frequency used for transfers to a device
+            ///
+            /// @scope: PUBLIC
+            /// @context: ANY
+            /// @param: addr - unsigned char. Address. Top 7 bits used
+            /// @return: unsigned long. SCL frequency
+            ///
+            ///////////////////////////////////////////////////////////////////////////////
+
+            unsigned long GetSpeed(unsigned char addr);
+
+            ///////////////////////////////////////////////////////////////////////////////
+            /// Benchmark
+            ///
+            /// Measure the read throughput achieved from a device: read len bytes
+            /// passes times, timed on the kernel clock. The count is of data bytes
+            /// only, so it includes the address and START/STOP overhead of each
+            /// transfer.
+            ///
+            /// @scope: PUBLIC
+            /// @context: TASK
+            /// @param: addr - unsigned char. Address. Top 7 bits used
+            /// @param: buf - unsigned char * Scratch buffer of len bytes
+            /// @param: len - bytes per transfer
+            /// @param: passes - number of transfers
+            /// @return: unsigned long. Bytes per second, zero if a transfer failed
+            ///
+            ///////////////////////////////////////////////////////////////////////////////
+
+            unsigned long Benchmark(unsigned char addr, unsigned char * buf, unsigned int len, unsigned int passes);
+
+            ///////////////////////////////////////////////////////////////////////////////
+            /// GetErrorStats
+            ///
+            /// Read the failure counters and the longest transfer time
+            ///
+            /// @scope: PUBLIC
+            /// @context: ANY
+            /// @param: stats - PIICERRSTATS. Filled in
+            /// @return: NONE
+            ///
+            ///////////////////////////////////////////////////////////////////////////////
+
+            void GetErrorStats(PIICERRSTATS stats);
+
+            ///////////////////////////////////////////////////////////////////////////////
+            /// ResetErrorStats
+            ///
+            /// Zero the failure counters and the longest transfer time
+            ///
+            /// @scope: PUBLIC
+            /// @context: ANY
+            /// @param: NONE
+            /// @return: NONE
+            ///
+            ///////////////////////////////////////////////////////////////////////////////
+
+            void ResetErrorStats(void);
+
+            #if IIC_STATS
+
+            ///////////////////////////////////////////////////////////////////////////////
+            /// GetAddrStats
+            ///
+            /// Read the traffic statistics for one address
+            ///
+            /// @scope: PUBLIC
+            /// @context: ANY
+            /// @param: addr - unsigned char. Address. Top 7 bits used
+            /// @param: stats - PIICADDRSTATS. Filled in
+            /// @return: int. Zero if successful, nonzero if the address has no
+            ///          statistics (never used, or the table was full)
+            ///
+            ///////////////////////////////////////////////////////////////////////////////
+
+            int GetAddrStats(unsigned char addr, PIICADDRSTATS stats);
+
+            ///////////////////////////////////////////////////////////////////////////////
+            /// GetBusUtilisation
+            ///
+            /// Share of the sliding window that the driver's transfers held the bus
+            ///
+            /// @scope: PUBLIC
+            /// @context: ANY
+            /// @param: NONE
+            /// @return: uint8_t. Percent
+            ///
+            ///////////////////////////////////////////////////////////////////////////////
+
+            uint8_t GetBusUtilisation(void);
+
+            ///////////////////////////////////////////////////////////////////////////////
+            /// ResetStats
+            ///
+            /// Forget the traffic statistics of every address
+            ///
+            /// @scope: PUBLIC
+            /// @context: ANY
+            /// @param: NONE
+            /// @return: NONE
+            ///
+            ///////////////////////////////////////////////////////////////////////////////
+
+            void ResetStats(void);
+
+            ///////////////////////////////////////////////////////////////////////////////
+            /// DumpStats
+            ///
+            /// Print the traffic statistics, one line per address then one for the
+            /// bus:
+            ///
+            ///     IIC,<addr hex>,<transfers>,<tx bytes>,<rx bytes>,<nacks>,<arb lost>,<bus us>
+            ///     IICBUS,<utilisation %>,<recoveries>,<worst us>
+            ///
+            /// @scope: PUBLIC
+            /// @context: TASK
+            /// @param: out - Print &. Where to print (e.g. Serial)
+            /// @return: NONE
+            ///
+            ///////////////////////////////////////////////////////////////////////////////
+
+            void DumpStats(Print & out);
+
+            #endif
     };
 }
-        
+
 #endif
@@ -4,16 +4,28 @@
 
 namespace Kernel {
 	Kernel::KernelClass OS;
+
+	KERNEL_RAM(KernelClass,sizeof(KernelClass));
 }
 
 void setup()
 {
+	Kernel::OS.PowerInit();
+	Kernel::OS.Timers.Init();
 	UserInit();
+	#if TASK_WATCHDOG
+	Kernel::OS.WatchdogInit();
+	#endif
 }
 
 
 void loop(void)
 {
-	Kernel::OS.MessageQueue.Loop(2);
-	Kernel::OS.TaskManager.Loop();
+	boolean busy;
+
+	busy=(Kernel::OS.DispatchMessages()!=0);
+	busy|=Kernel::OS.TaskManager.Loop();
+	busy|=Kernel::OS.IICDriver.Poll();
+	Kernel::OS.Housekeeping();
+	Kernel::OS.Idle(busy);
 }
@@ -14,6 +14,7 @@ extern void UserInit(void);
 
 #include "KernelClass.h"
 #include "ostimer.h"
+#include "coroutine.h"
 #include "EventReceiver.h"
 
 namespace Kernel {
@@ -10,8 +10,10 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #include "mq.h"
+#include "mqroute.h"
 #include "EventReceiver.h"
-#include "interrupts.h"
+#include "taskring.h"
+#include "timerservice.h"
 #include <stdlib.h>
 
 namespace Kernel {
@@ -36,6 +38,17 @@ namespace Kernel {
 			virtual ~MHFUNCTION() {};
 	};
 
+	typedef class MHTYPED * PMHTYPED;
+	class MHTYPED : public MESSAGEHANDLER {
+		public:
+			PFNMSGGENERIC	msgHandler;
+			PFNMSGTHUNK		msgThunk;
+			virtual void Call(int id, void * context) { this->msgThunk(msgHandler,context); };
+			virtual boolean checkHandler(void * handler) { return (PFNMSGGENERIC)handler==msgHandler; };
+			MHTYPED(PFNMSGGENERIC pHandler, PFNMSGTHUNK pThunk, PMESSAGEHANDLER NextHandler) : msgHandler(pHandler), msgThunk(pThunk), MESSAGEHANDLER(NextHandler) {};
+			virtual ~MHTYPED() {};
+	};
+
 	typedef class MHCLASS * PMHCLASS;
 	class MHCLASS : public MESSAGEHANDLER {
 		public:
@@ -46,14 +59,65 @@ namespace Kernel {
 			virtual ~MHCLASS() {};
 	};
 
+	// Message payload: either the context pointer passed to Post, or a copy of
+	// the value passed to Post<T>.
+
+	typedef union MSGPAYLOAD {
+		void *		context;
+		uint8_t		Data[MSG_PAYLOAD_SIZE];
+	} MSGPAYLOAD;
+
+	static_assert(MSG_PAYLOAD_SIZE>=sizeof(void *),"MSG_PAYLOAD_SIZE must hold a context pointer");
+
+	// A message slot. These live in statically allocated rings, so posting never
+	// touches the heap.
+
 	typedef class MESSAGE * 	PMESSAGE;
 	class MESSAGE {
 		public:
-			int 		msgid;
-			void *		context;
-			MQOWNER		CallerOwns;
-			PMESSAGE 	pNextMsg;
-			MESSAGE(int id, void * context, MQOWNER owner) : msgid(id),context(context),CallerOwns(owner),pNextMsg(NULL) {};
+			uint8_t		msgid;
+			uint8_t		CallerOwns;
+			MSGPAYLOAD	Payload;
+			#if MQ_STATS
+			unsigned long	Stamp;		// TimerService::Now() at post
+			#endif
+	};
+
+	// Compiler barrier. The AVR core executes in order, so all we need is to stop
+	// the compiler moving slot accesses across the index update that publishes
+	// (or releases) them.
+
+	#define MQ_BARRIER()		asm volatile("" ::: "memory")
+
+	// Coalescing cell. Holds the most recently posted payload for a coalesced
+	// msgid. The producer writes Payload and Owner then bumps Seq; the consumer
+	// re-reads until Seq is stable, so an interrupt replacing the value part-way
+	// through a read is detected without masking interrupts.
+
+	typedef class MSGCELL *		PMSGCELL;
+	class MSGCELL {
+		public:
+			MSGPAYLOAD				Payload;
+			uint8_t					Owner;		// MQ_OWNER_CALLER or MQ_OWNER_INLINE
+			volatile uint8_t		Seq;
+			volatile uint8_t		Pending;	// a marker for this cell is queued
+			uint8_t					msgid;		// msgid the cell is bound to
+	};
+
+	// Single-producer/single-consumer ring. Head is only ever written by the
+	// producing context and Tail only by the consumer (MQClass::Loop). Both are
+	// free-running 8-bit counters, so a single byte store publishes them
+	// atomically and no interrupt masking is required on either side.
+
+	typedef class MSGRING *		PMSGRING;
+	class MSGRING {
+		public:
+			PMESSAGE				Slots;
+			uint8_t					Mask;
+			volatile uint8_t		Head;		// next slot to write (producer)
+			volatile uint8_t		Tail;		// next slot to read (consumer)
+			volatile uint8_t		Peak;		// deepest the ring has been (producer)
+			volatile unsigned int	Rejected;	// posts refused because the ring was full (producer)
 	};
 
 	// message queue block
@@ -61,10 +125,120 @@ namespace Kernel {
 	class MQInternals {
 		public:
 			PMESSAGEHANDLER		QueueBlock[MSG_MAX_MSG_IDS];
-			PMESSAGE			MsgQueueFirst;
-			PMESSAGE			MsgQueueLast;
+			const MQROUTETABLE *	Routes;			// compile-time routes, in flash
+			uint8_t				Priority[MSG_MAX_MSG_IDS];	// default lane for each msgid
+			uint8_t				Coalesce[MSG_MAX_MSG_IDS];	// coalescing cell index+1, zero if not coalesced
+			uint8_t				CellsUsed;
+			MSGCELL				Cells[MSG_MAX_COALESCED];
+			MSGRING				Rings[MQ_NUM_PRIORITIES][MQ_NUM_CONTEXTS];
+			unsigned int		Dispatched[MQ_NUM_PRIORITIES];
+			#if MQ_STATS
+			MQMSGSTATS			MsgStats[MSG_MAX_MSG_IDS];
+			volatile uint8_t	HighWater;
+			unsigned long		TotalDispatched;
+			unsigned long		LatencyWorst;
+			unsigned long		LatencyTotal;
+			unsigned long		HandlerTotal;
+			#endif
 	};
 
+	// the single internals block and ring storage. Static, so they are zeroed by
+	// the C runtime.
+
+	static MQInternals mqInternals;
+	static MESSAGE mqTaskSlots[MQ_NUM_PRIORITIES][MSG_QUEUE_DEPTH];
+	static MESSAGE mqIntSlots[MQ_NUM_PRIORITIES][MSG_INT_QUEUE_DEPTH];
+
+	KERNEL_RAM(MessageQueue,sizeof(mqInternals)+sizeof(mqTaskSlots)+sizeof(mqIntSlots));
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// RingPush
+	///
+	/// Producer side of a ring. Only ever called from the context that owns the
+	/// ring.
+	///
+	/// @context:	owning context of the ring
+	/// @scope:     INTERNAL
+	/// @param:     PMSGRING ring
+	/// @param:     int msgid
+	/// @param:     const void * data, uint8_t size - payload to copy
+	/// @param:     uint8_t CallerOwns - ownership of the payload
+	/// @return:	zero if queued, nonzero if the ring was full
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	static int RingPush(PMSGRING ring, int msgid, const void * data, uint8_t size, uint8_t CallerOwns)
+	{
+		uint8_t head=ring->Head;
+		if((uint8_t)(head-ring->Tail)>ring->Mask) {
+			ring->Rejected++;
+			return -1;
+		}
+		PMESSAGE slot=&ring->Slots[head&ring->Mask];
+		slot->msgid=msgid;
+		memcpy(slot->Payload.Data,data,size);
+		slot->CallerOwns=CallerOwns;
+		#if MQ_STATS
+		slot->Stamp=TimerService::Now();
+		#endif
+		MQ_BARRIER();					// slot must be complete before it is published
+		ring->Head=++head;
+		head-=ring->Tail;
+		if(head>ring->Peak) {
+			ring->Peak=head;
+		}
+		return 0;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// RingPop
+	///
+	/// Consumer side of a ring. The slot is copied out before it is released so
+	/// the producer may reuse it immediately.
+	///
+	/// @context:	TASK
+	/// @scope:     INTERNAL
+	/// @param:     PMSGRING ring
+	/// @param:     PMESSAGE msg - receives the message
+	/// @return:	nonzero if a message was popped
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	static boolean RingPop(PMSGRING ring, PMESSAGE msg)
+	{
+		uint8_t tail=ring->Tail;
+		if(tail==ring->Head) {
+			return false;
+		}
+		MQ_BARRIER();					// don't read the slot before we've seen Head
+		*msg=ring->Slots[tail&ring->Mask];
+		MQ_BARRIER();					// slot must be read before it is released
+		ring->Tail=tail+1;
+		return true;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// ReadCounter
+	///
+	/// Read a 16-bit counter that an interrupt may be updating. Rather than
+	/// masking interrupts, re-read until two consecutive reads agree.
+	///
+	/// @context:	TASK
+	/// @scope:     INTERNAL
+	/// @param:     volatile unsigned int * counter
+	/// @return:	unsigned int - counter value
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	static unsigned int ReadCounter(volatile unsigned int * counter)
+	{
+		unsigned int val;
+		do {
+			val=*counter;
+		} while(val!=*counter);
+		return val;
+	}
+
 	//////////////////////////////////////////////////////////////////////////////
 	/// MQClass
 	///
@@ -80,12 +254,20 @@ namespace Kernel {
 
 	MQClass::MQClass(void)
 	{
-		MQInternals * pInternals=new MQInternals;
+		MQInternals * pInternals=&mqInternals;
 		for(int idx=0;idx<MSG_MAX_MSG_IDS;idx++) {
 			pInternals->QueueBlock[idx]=(PMESSAGEHANDLER)NULL;
 		}
-		pInternals->MsgQueueFirst=(PMESSAGE)NULL;
-		pInternals->MsgQueueLast=(PMESSAGE)NULL;
+		for(int idx=0;idx<MSG_MAX_MSG_IDS;idx++) {
+			pInternals->Priority[idx]=MQ_PRIORITY_UI;
+		}
+		pInternals->Routes=NULL;
+		for(int lane=0;lane<MQ_NUM_PRIORITIES;lane++) {
+			pInternals->Rings[lane][MQ_CONTEXT_TASK].Slots=mqTaskSlots[lane];
+			pInternals->Rings[lane][MQ_CONTEXT_TASK].Mask=MSG_QUEUE_DEPTH-1;
+			pInternals->Rings[lane][MQ_CONTEXT_INTERRUPT].Slots=mqIntSlots[lane];
+			pInternals->Rings[lane][MQ_CONTEXT_INTERRUPT].Mask=MSG_INT_QUEUE_DEPTH-1;
+		}
 		internals=(void *)pInternals;
 	}
 
@@ -295,10 +477,33 @@ namespace Kernel {
 		}
 	}
 
+	//////////////////////////////////////////////////////////////////////////////
+	/// SetStaticRoutes
+	///
+	/// Attach a compile-time route table (see mqroute.h). Routed handlers are
+	/// called before any handlers subscribed at runtime. Pass NULL to detach.
+	///
+	/// @context:	TASK
+	/// @scope:     EXPORTED
+	/// @param:     const MQROUTETABLE * routes - table in flash, built with
+	///             MQ_ROUTE_TABLE
+	/// @return:	none
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	void MQClass::SetStaticRoutes(const MQROUTETABLE * routes)
+	{
+		MQInternals * pInternals = (MQInternals *)internals;
+		pInternals->Routes=routes;
+	}
+
 	//////////////////////////////////////////////////////////////////////////////
 	/// Post
 	///
-	/// Post a message. Pass id of message and context to be passed.
+	/// Post a message. Pass id of message and context to be passed. The message
+	/// is copied into the next free slot of the ring belonging to the calling
+	/// context in the requested priority lane; if that ring is full the post is
+	/// rejected and counted. Interrupts are never masked.
 	///
 	/// @context:	TASK, INTERRUPT
 	/// @scope:     EXPORTED
@@ -306,89 +511,562 @@ namespace Kernel {
 	/// @param:     void * context - pointer to context data
 	/// @param:     boolean CallerOwns - set TRUE if the message queue is not to
 	///	            free the context data when done.
-	/// @param:     boolean isIntCtx - set this TRUE if called from an interrupt
-	///             context.
+	/// @param:     MQCONTEXT isIntCtx - context the caller is running in
+	/// @param:     MQPRIORITY priority - lane to post in, or MQ_PRIORITY_DEFAULT
+	///             for the priority configured for the msgid.
 	///
 	/// @return:	zero if successfully posted, nonzero if error occurred
 	///
 	//////////////////////////////////////////////////////////////////////////////
 
-	int MQClass::Post(int msgid, void * context, MQOWNER CallerOwns, MQCONTEXT isIntCtx)
+	int MQClass::Post(int msgid, void * context, MQOWNER CallerOwns, MQCONTEXT isIntCtx, MQPRIORITY priority)
+	{
+		return PostPayload(msgid,&context,sizeof(context),CallerOwns,isIntCtx,priority);
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// PostPayload
+	///
+	/// Common implementation of Post and Post<T>: copies size bytes of payload
+	/// into a message slot (or the msgid's coalescing cell).
+	///
+	/// @context:	TASK, INTERRUPT
+	/// @scope:     PRIVATE
+	/// @param:     int msgid
+	/// @param:     const void * data - payload to copy
+	/// @param:     uint8_t size - payload size, at most MSG_PAYLOAD_SIZE
+	/// @param:     uint8_t CallerOwns - MQ_OWNER_CALLER, MQ_OWNER_MQ or
+	///             MQ_OWNER_INLINE
+	/// @param:     MQCONTEXT isIntCtx - context the caller is running in
+	/// @param:     MQPRIORITY priority - lane to post in
+	/// @return:	zero if successfully posted, nonzero if error occurred
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	int MQClass::PostPayload(int msgid, const void * data, uint8_t size, uint8_t CallerOwns, MQCONTEXT isIntCtx, MQPRIORITY priority)
 	{
 		MQInternals * pInternals = (MQInternals *)internals;
 		int rc=-1;
-		if(isIntCtx!=MQ_CONTEXT_INTERRUPT) INTDisableMasterInterrupts();
-		if(msgid<MSG_MAX_MSG_IDS && (msgid!=MSG_ID_NOMESSAGE)) {
-			PMESSAGE newMessage=new MESSAGE(msgid,context,CallerOwns);
-			if(newMessage) {
-				if(pInternals->MsgQueueFirst==NULL) {
+		if((msgid>=0) && (msgid<MSG_MAX_MSG_IDS) && (isIntCtx<MQ_NUM_CONTEXTS) && (size<=MSG_PAYLOAD_SIZE)) {
+			if(priority>=MQ_NUM_PRIORITIES) {
+				priority=(MQPRIORITY)pInternals->Priority[msgid];
+			}
+			PMSGRING ring=&pInternals->Rings[priority][isIntCtx];
+			uint8_t cellidx=pInternals->Coalesce[msgid];
+			if(!cellidx) {
+				rc=RingPush(ring,msgid,data,size,CallerOwns);
+			} else if(CallerOwns!=MQ_OWNER_MQ) {
 
-					// the first in the list
+				// coalesced: replace the latest value, and only queue a marker if
+				// there isn't one already pending
 
-					pInternals->MsgQueueFirst=pInternals->MsgQueueLast=newMessage;
-				} else {
+				PMSGCELL cell=&pInternals->Cells[cellidx-1];
+				memcpy(cell->Payload.Data,data,size);
+				cell->Owner=CallerOwns;
+				MQ_BARRIER();
+				cell->Seq++;
+				rc=0;
+				if(!cell->Pending) {
+					cell->Pending=1;
+					rc=RingPush(ring,msgid,&cell,sizeof(cell),MQ_OWNER_CELL);
+					if(rc) {
+						cell->Pending=0;
+					}
+				}
+			}
 
-					// attach to the bottom
+			#if MQ_STATS
+			if(rc) {
+				pInternals->MsgStats[msgid].Dropped++;
+			} else {
+				uint8_t depth=GetDepth();
+				pInternals->MsgStats[msgid].Posted++;
+				if(depth>pInternals->HighWater) {
+					pInternals->HighWater=depth;
+				}
+			}
+			#endif
+		}
+		return rc;
+	}
 
-					pInternals->MsgQueueLast->pNextMsg=newMessage;
-					pInternals->MsgQueueLast=newMessage;
+	//////////////////////////////////////////////////////////////////////////////
+	/// SubscribeTyped
+	///
+	/// Common implementation of Subscribe<T>. The handler is stored untyped
+	/// alongside a thunk that restores its type and passes it the payload.
+	///
+	/// @context:	TASK
+	/// @scope:     PRIVATE
+	/// @param:     int msgid
+	/// @param:     PFNMSGGENERIC handler - the typed handler
+	/// @param:     PFNMSGTHUNK thunk - thunk that calls it
+	/// @return:	zero if successfully subscribed, nonzero if error occurred
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	int MQClass::SubscribeTyped(int msgid, PFNMSGGENERIC handler, PFNMSGTHUNK thunk)
+	{
+		MQInternals * pInternals = (MQInternals *)internals;
+		int rc=-1;
+		if((msgid>=0) && (msgid<MSG_MAX_MSG_IDS) && (handler!=NULL)) {
+			// don't attach it twice
+			PMESSAGEHANDLER pHead=pInternals->QueueBlock[msgid];
+			while(pHead) {
+				if(pHead->checkHandler((void *)handler)) {
+					break;
+				}
+				pHead=pHead->pNextHandler;
+			}
+			if(!pHead) {
+				pHead=new MHTYPED(handler,thunk,pInternals->QueueBlock[msgid]);
+				if(pHead) {
+					pInternals->QueueBlock[msgid]=pHead;
+					rc=0;
 				}
+			}
+		}
+		return rc;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// SetPriority
+	///
+	/// Set the priority lane used for a msgid when it is posted with
+	/// MQ_PRIORITY_DEFAULT.
+	///
+	/// @context:	TASK
+	/// @scope:     EXPORTED
+	/// @param:     int msgid
+	/// @param:     MQPRIORITY priority
+	/// @return:	zero if successful, nonzero if error occurred
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	int MQClass::SetPriority(int msgid, MQPRIORITY priority)
+	{
+		MQInternals * pInternals = (MQInternals *)internals;
+		int rc=-1;
+		if((msgid>=0) && (msgid<MSG_MAX_MSG_IDS) && (priority<MQ_NUM_PRIORITIES)) {
+			pInternals->Priority[msgid]=priority;
+			rc=0;
+		}
+		return rc;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// SetCoalesce
+	///
+	/// Put a msgid into (or take it out of) coalescing mode. A coalescing cell is
+	/// bound to the msgid the first time it is coalesced and kept thereafter, so
+	/// a marker still queued when the mode is turned off remains valid.
+	///
+	/// @context:	TASK
+	/// @scope:     EXPORTED
+	/// @param:     int msgid
+	/// @param:     boolean enable
+	/// @return:	zero if successful, nonzero if error occurred
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	int MQClass::SetCoalesce(int msgid, boolean enable)
+	{
+		MQInternals * pInternals = (MQInternals *)internals;
+		int rc=-1;
+		if((msgid>=0) && (msgid<MSG_MAX_MSG_IDS)) {
+			if(!enable) {
+				pInternals->Coalesce[msgid]=0;
 				rc=0;
+			} else if(pInternals->Coalesce[msgid]) {
+				rc=0;
+			} else {
+
+				// reuse the cell if this msgid was coalesced before
+
+				uint8_t idx;
+				for(idx=0;idx<pInternals->CellsUsed;idx++) {
+					if(pInternals->Cells[idx].msgid==msgid) {
+						break;
+					}
+				}
+				if(idx<MSG_MAX_COALESCED) {
+					if(idx==pInternals->CellsUsed) {
+						pInternals->Cells[idx].msgid=msgid;
+						pInternals->CellsUsed++;
+					}
+					pInternals->Coalesce[msgid]=idx+1;
+					rc=0;
+				}
+			}
+		}
+		return rc;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// GetLaneStats
+	///
+	/// Obtain depth statistics for a priority lane. Depth is a snapshot; the
+	/// peak is the deepest any single producer's ring in the lane has been.
+	///
+	/// @context:	TASK
+	/// @scope:     EXPORTED
+	/// @param:     MQPRIORITY lane
+	/// @param:     MQLANESTATS * stats - receives the statistics
+	/// @return:	zero if successful, nonzero if error occurred
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	int MQClass::GetLaneStats(MQPRIORITY lane, MQLANESTATS * stats)
+	{
+		MQInternals * pInternals = (MQInternals *)internals;
+		int rc=-1;
+		if((lane<MQ_NUM_PRIORITIES) && stats) {
+			stats->Depth=0;
+			stats->PeakDepth=0;
+			stats->Rejected=0;
+			for(int ctx=0;ctx<MQ_NUM_CONTEXTS;ctx++) {
+				PMSGRING ring=&pInternals->Rings[lane][ctx];
+				stats->Depth+=(uint8_t)(ring->Head-ring->Tail);
+				stats->PeakDepth=IMAX(stats->PeakDepth,ring->Peak);
+				stats->Rejected+=ReadCounter(&ring->Rejected);
+			}
+			stats->Dispatched=pInternals->Dispatched[lane];
+			rc=0;
+		}
+		return rc;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// GetRejectedCount
+	///
+	/// Returns the number of posts rejected since startup because the ring for
+	/// the posting context was full.
+	///
+	/// @context:	ANY
+	/// @scope:     EXPORTED
+	/// @param:     none
+	/// @return:	unsigned int - count of rejected posts
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	unsigned int MQClass::GetRejectedCount(void)
+	{
+		MQInternals * pInternals = (MQInternals *)internals;
+		unsigned int count=0;
+		for(int lane=0;lane<MQ_NUM_PRIORITIES;lane++) {
+			for(int ctx=0;ctx<MQ_NUM_CONTEXTS;ctx++) {
+				count+=ReadCounter(&pInternals->Rings[lane][ctx].Rejected);
+			}
+		}
+		return count;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// GetDepth
+	///
+	/// Returns the number of messages currently queued across all lanes and
+	/// contexts.
+	///
+	/// @context:	ANY
+	/// @scope:     EXPORTED
+	/// @param:     none
+	/// @return:	unsigned int - messages pending
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	unsigned int MQClass::GetDepth(void)
+	{
+		MQInternals * pInternals = (MQInternals *)internals;
+		unsigned int depth=0;
+		for(int lane=0;lane<MQ_NUM_PRIORITIES;lane++) {
+			for(int ctx=0;ctx<MQ_NUM_CONTEXTS;ctx++) {
+				PMSGRING ring=&pInternals->Rings[lane][ctx];
+				depth+=(uint8_t)(ring->Head-ring->Tail);
 			}
 		}
-		if(isIntCtx!=MQ_CONTEXT_INTERRUPT) INTEnableMasterInterrupts();
+		return depth;
+	}
+
+	#if MQ_STATS
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// GetMsgStats
+	///
+	/// Obtain the instrumentation counters for a msgid.
+	///
+	/// @context:	TASK
+	/// @scope:     EXPORTED
+	/// @param:     int msgid
+	/// @param:     MQMSGSTATS * stats - receives the statistics
+	/// @return:	zero if successful, nonzero if error occurred
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	int MQClass::GetMsgStats(int msgid, MQMSGSTATS * stats)
+	{
+		MQInternals * pInternals = (MQInternals *)internals;
+		int rc=-1;
+		if((msgid>=0) && (msgid<MSG_MAX_MSG_IDS) && stats) {
+			*stats=pInternals->MsgStats[msgid];
+			rc=0;
+		}
 		return rc;
 	}
 
+	//////////////////////////////////////////////////////////////////////////////
+	/// GetQueueStats
+	///
+	/// Obtain the whole-queue instrumentation counters.
+	///
+	/// @context:	TASK
+	/// @scope:     EXPORTED
+	/// @param:     MQQUEUESTATS * stats - receives the statistics
+	/// @return:	none
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	void MQClass::GetQueueStats(MQQUEUESTATS * stats)
+	{
+		MQInternals * pInternals = (MQInternals *)internals;
+		if(stats) {
+			unsigned long n=pInternals->TotalDispatched;
+			stats->HighWater=pInternals->HighWater;
+			stats->Dispatched=n;
+			stats->LatencyWorst=pInternals->LatencyWorst;
+			stats->LatencyMean=n?(pInternals->LatencyTotal/n):0;
+			stats->HandlerMean=n?(pInternals->HandlerTotal/n):0;
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// ResetStats
+	///
+	/// Zero all instrumentation counters.
+	///
+	/// @context:	TASK
+	/// @scope:     EXPORTED
+	/// @param:     none
+	/// @return:	none
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	void MQClass::ResetStats(void)
+	{
+		MQInternals * pInternals = (MQInternals *)internals;
+		memset(pInternals->MsgStats,0,sizeof(pInternals->MsgStats));
+		pInternals->HighWater=0;
+		pInternals->TotalDispatched=0;
+		pInternals->LatencyWorst=0;
+		pInternals->LatencyTotal=0;
+		pInternals->HandlerTotal=0;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// DumpStats
+	///
+	/// Print the instrumentation in a compact CSV-style form (see mq.h).
+	///
+	/// @context:	TASK
+	/// @scope:     EXPORTED
+	/// @param:     Print & out - where to print (e.g. Serial)
+	/// @return:	none
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	void MQClass::DumpStats(Print & out)
+	{
+		MQInternals * pInternals = (MQInternals *)internals;
+		MQQUEUESTATS q;
+
+		GetQueueStats(&q);
+		out.print(F("MQ,"));
+		out.print((unsigned int)q.HighWater);
+		out.print(',');
+		out.print(q.Dispatched);
+		out.print(',');
+		out.print(q.LatencyWorst);
+		out.print(',');
+		out.print(q.LatencyMean);
+		out.print(',');
+		out.print(q.HandlerMean);
+		out.print(',');
+		out.println(GetRejectedCount());
+
+		for(int idx=0;idx<MSG_MAX_MSG_IDS;idx++) {
+			MQMSGSTATS * pStats=&pInternals->MsgStats[idx];
+			if(pStats->Posted || pStats->Dropped) {
+				out.print(F("M,"));
+				out.print(idx);
+				out.print(',');
+				out.print(pStats->Posted);
+				out.print(',');
+				out.print(pStats->Dispatched);
+				out.print(',');
+				out.print(pStats->Dropped);
+				out.print(',');
+				out.print(pStats->HandlerWorst);
+				out.print(',');
+				out.println(pStats->Dispatched?(pStats->HandlerTotal/pStats->Dispatched):0UL);
+			}
+		}
+	}
+
+	#endif
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// PopNext
+	///
+	/// Take the next message to dispatch. Lanes are drained strictly in priority
+	/// order; within a lane the interrupt ring is checked before the task ring so
+	/// that interrupt-sourced events are not held behind task-time traffic.
+	///
+	/// @context:	TASK
+	/// @scope:     INTERNAL
+	/// @param:     MQInternals * pInternals
+	/// @param:     PMESSAGE msg - receives the message
+	/// @return:	nonzero if a message was popped
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	static boolean PopNext(MQInternals * pInternals, PMESSAGE msg)
+	{
+		for(int lane=0;lane<MQ_NUM_PRIORITIES;lane++) {
+			if(RingPop(&pInternals->Rings[lane][MQ_CONTEXT_INTERRUPT],msg) ||
+			   RingPop(&pInternals->Rings[lane][MQ_CONTEXT_TASK],msg)) {
+				pInternals->Dispatched[lane]++;
+				return true;
+			}
+		}
+		return false;
+	}
+
 	//////////////////////////////////////////////////////////////////////////////
 	/// MQLoop
 	///
-	/// Called by the task handler. Processes up to MaxMessages and returns
+	/// Called by the task handler. Processes up to MaxMessages and returns,
+	/// taking messages in priority order (see PopNext).
 	///
 	/// @context:	TASK
 	/// @scope:     EXPORTED
 	/// @param:     int MaxMessages -  maximum number of messages to process in
 	///             this iteration
-	/// @return:    none
+	/// @return:    int - number of messages processed
 	///
 	//////////////////////////////////////////////////////////////////////////////
 
-	void MQClass::Loop(int MaxMessages)
+	int MQClass::Loop(int MaxMessages)
 	{
 		MQInternals * pInternals = (MQInternals *)internals;
-		while(MaxMessages) {
+		MESSAGE msg;
+		int count=0;
+		while(count<MaxMessages) {
 
-			// pop the first off the queue
+			// pop the next message in priority order
 
-			INTDisableMasterInterrupts();
-			PMESSAGE msg=pInternals->MsgQueueFirst;
-			if(msg) {
-				pInternals->MsgQueueFirst=msg->pNextMsg;
-				if(pInternals->MsgQueueFirst==NULL) {
-					pInternals->MsgQueueLast=NULL;
-				}
+			if(!PopNext(pInternals,&msg)) {
+				break;			// nothing left to do
 			}
-			INTEnableMasterInterrupts();
-
-			// send it in
-			if(msg) {
-				PMESSAGEHANDLER curHandler=pInternals->QueueBlock[msg->msgid];
-				while(curHandler) {
-					curHandler->Call(msg->msgid,msg->context);
-					curHandler=curHandler->pNextHandler;
+
+			// a coalesced marker: fetch the latest value from its cell. Pending is
+			// cleared first, so a post racing with us queues a fresh marker rather
+			// than being lost.
+
+			if(msg.CallerOwns==MQ_OWNER_CELL) {
+				PMSGCELL cell=(PMSGCELL)msg.Payload.context;
+				uint8_t seq;
+				cell->Pending=0;
+				do {
+					seq=cell->Seq;
+					MQ_BARRIER();
+					msg.Payload=cell->Payload;
+					msg.CallerOwns=cell->Owner;
+					MQ_BARRIER();
+				} while(seq!=cell->Seq);
+			}
+
+			// handlers get the context pointer, or a pointer to the inline payload.
+			// msg is our own copy, so the payload stays valid for every handler.
+
+			void * context=(msg.CallerOwns==MQ_OWNER_INLINE)?(void *)msg.Payload.Data:msg.Payload.context;
+
+			#if MQ_STATS
+			unsigned long start=TimerService::Now();
+			unsigned long latency=start-msg.Stamp;
+			pInternals->LatencyTotal+=latency;
+			if(latency>pInternals->LatencyWorst) {
+				pInternals->LatencyWorst=latency;
+			}
+			#endif
+
+			// send it in: compile-time route first, then runtime subscribers
+
+			if(pInternals->Routes) {
+				PFNMQROUTE route=(PFNMQROUTE)pgm_read_word(&pInternals->Routes->Handler[msg.msgid]);
+				if(route) {
+					route(msg.msgid,context);
 				}
+			}
 
-				// free the message
+			PMESSAGEHANDLER curHandler=pInternals->QueueBlock[msg.msgid];
+			while(curHandler) {
+				curHandler->Call(msg.msgid,context);
+				curHandler=curHandler->pNextHandler;
+			}
 
-				if(msg->CallerOwns!=MQ_OWNER_CALLER) {
-					if(msg->context != NULL) {
-						delete msg->context;
-					}
+			#if MQ_STATS
+			unsigned long elapsed=TimerService::Now()-start;
+			MQMSGSTATS * pStats=&pInternals->MsgStats[msg.msgid];
+			pStats->Dispatched++;
+			pStats->HandlerTotal+=elapsed;
+			if(elapsed>pStats->HandlerWorst) {
+				pStats->HandlerWorst=(unsigned int)IMIN(elapsed,0xffffUL);
+			}
+			pInternals->HandlerTotal+=elapsed;
+			pInternals->TotalDispatched++;
+			#endif
+
+			// then wake any task waiting for it
+
+			TaskRing::Get().NotifyMessage(msg.msgid);
+
+			// free the context if we own it. It is untyped, so only the storage is
+			// released: no destructor is run.
+
+			if(msg.CallerOwns==MQ_OWNER_MQ) {
+				if(context != NULL) {
+					::operator delete(context);
 				}
-				delete msg;
 			}
-			MaxMessages--;
+			count++;
 		}
+		return count;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// LoopFor
+	///
+	/// Called by the kernel scheduler. Processes messages until the queue is
+	/// empty or the time budget is spent. The budget is checked between
+	/// messages, so a pass can overrun it by at most one message's handlers.
+	///
+	/// @context:	TASK
+	/// @scope:     EXPORTED
+	/// @param:     unsigned long budget - time budget in microseconds
+	/// @return:    int - number of messages processed
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	int MQClass::LoopFor(unsigned long budget)
+	{
+		unsigned long start=TimerService::Now();
+		int count=0;
+		do {
+			if(!this->Loop(1)) {
+				break;
+			}
+			count++;
+		} while((TimerService::Now()-start)<budget);
+		return count;
 	}
 
 }
@@ -22,13 +22,122 @@ namespace Kernel {
 	#define MSG_MAX_MSG_IDS				26
 
 	//
-	// context enum
+	// Number of statically allocated message slots in each task-context ring and
+	// each interrupt-context ring (there is one of each per priority lane). Each
+	// must be a power of two so the ring indices can be wrapped with a mask. Posts
+	// made while a ring is full are rejected and counted (see GetRejectedCount).
+
+	#ifndef MSG_QUEUE_DEPTH
+	#define MSG_QUEUE_DEPTH				8
+	#endif
+
+	#ifndef MSG_INT_QUEUE_DEPTH
+	#define MSG_INT_QUEUE_DEPTH			4
+	#endif
+
+	//
+	// Maximum number of msgids that can be put in coalescing mode (see
+	// SetCoalesce). Each costs one small cell of RAM.
+
+	#ifndef MSG_MAX_COALESCED
+	#define MSG_MAX_COALESCED			4
+	#endif
+
+	//
+	// Size in bytes of the payload carried inline in each message slot. Post<T>
+	// accepts any trivially copyable T up to this size; it must also be large
+	// enough to hold a context pointer.
+
+	#ifndef MSG_PAYLOAD_SIZE
+	#define MSG_PAYLOAD_SIZE			4
+	#endif
+
+	//
+	// Set MQ_STATS to 1 to build in the message queue instrumentation: per-msgid
+	// post/dispatch/drop counters and handler times, the queue high-water mark,
+	// and post-to-dispatch latency. It costs about 12 bytes of RAM per msgid and
+	// 4 per message slot, so it is off by default; when off, none of it (including
+	// the query functions) is compiled.
+
+	#ifndef MQ_STATS
+	#define MQ_STATS					0
+	#endif
+
+	#if (MSG_QUEUE_DEPTH & (MSG_QUEUE_DEPTH-1)) || (MSG_QUEUE_DEPTH > 128)
+	#error "MSG_QUEUE_DEPTH must be a power of two no greater than 128"
+	#endif
+
+	#if (MSG_INT_QUEUE_DEPTH & (MSG_INT_QUEUE_DEPTH-1)) || (MSG_INT_QUEUE_DEPTH > 128)
+	#error "MSG_INT_QUEUE_DEPTH must be a power of two no greater than 128"
+	#endif
+
+	//
+	// context enum. Each context posts into its own single-producer ring, so no
+	// context ever has to mask interrupts to post. AVR interrupts do not nest
+	// unless an ISR explicitly re-enables them, so every ISR source shares the
+	// MQ_CONTEXT_INTERRUPT ring as a single producer. An ISR declared with
+	// ISR_NOBLOCK that posts must be given its own context (and ring) here.
 
 	typedef enum MQCONTEXT {
 		MQ_CONTEXT_TASK,
-		MQ_CONTEXT_INTERRUPT
+		MQ_CONTEXT_INTERRUPT,
+		MQ_NUM_CONTEXTS
+	};
+
+	//
+	// priority enum. Each priority class is a separate lane; Loop always drains
+	// a higher lane completely before it takes anything from a lower one, so a
+	// backlog of background traffic can't delay control or UI messages.
+	// MQ_PRIORITY_DEFAULT posts at the priority configured for the msgid with
+	// SetPriority (MQ_PRIORITY_UI unless changed).
+
+	typedef enum MQPRIORITY {
+		MQ_PRIORITY_CONTROL,
+		MQ_PRIORITY_UI,
+		MQ_PRIORITY_BACKGROUND,
+		MQ_NUM_PRIORITIES,
+		MQ_PRIORITY_DEFAULT=MQ_NUM_PRIORITIES
 	};
 
+	//
+	// per-lane statistics, see GetLaneStats
+
+	typedef struct MQLANESTATS {
+		uint8_t			Depth;			// messages currently queued in the lane
+		uint8_t			PeakDepth;		// deepest any one of the lane's rings has been
+		unsigned int	Rejected;		// posts refused because the lane was full
+		unsigned int	Dispatched;		// messages taken from the lane (wraps)
+	} MQLANESTATS;
+
+	#if MQ_STATS
+
+	//
+	// per-msgid statistics, see GetMsgStats. Times in microseconds. Counters
+	// are updated by the posting context without masking interrupts, so a
+	// msgid posted from both task and interrupt context may occasionally
+	// lose a count.
+
+	typedef struct MQMSGSTATS {
+		unsigned int	Posted;			// accepted posts (including coalesced replacements)
+		unsigned int	Dispatched;		// messages delivered to handlers
+		unsigned int	Dropped;		// posts refused because the ring was full
+		unsigned int	HandlerWorst;	// longest time spent in this msgid's handlers
+		unsigned long	HandlerTotal;	// total time spent in this msgid's handlers
+	} MQMSGSTATS;
+
+	//
+	// whole-queue statistics, see GetQueueStats. Times in microseconds.
+
+	typedef struct MQQUEUESTATS {
+		uint8_t			HighWater;		// most messages queued at once
+		unsigned long	Dispatched;		// messages delivered
+		unsigned long	LatencyWorst;	// longest post-to-dispatch time
+		unsigned long	LatencyMean;	// mean post-to-dispatch time
+		unsigned long	HandlerMean;	// mean time in handlers per message
+	} MQQUEUESTATS;
+
+	#endif
+
 	//
 	// ownership enum
 
@@ -37,11 +146,52 @@ namespace Kernel {
 		MQ_OWNER_MQ
 	};
 
+	//
+	// internal ownership values: never passed to Post
+
+	#define MQ_OWNER_CELL				2		// payload is in the msgid's coalescing cell
+	#define MQ_OWNER_INLINE				3		// payload was copied into the message by Post<T>
+
 	//
 	// Prototype of message handler callback function for function-based task handlers
 
 	typedef void (* PFNMSGHANDLER)(void * context);
 
+	//
+	// Typed message handlers (see Subscribe<T>) are stored untyped and called
+	// through a thunk generated for their payload type
+
+	typedef void (* PFNMSGGENERIC)(void);
+	typedef void (* PFNMSGTHUNK)(PFNMSGGENERIC handler, void * context);
+
+	template<class T> void MQTypedThunk(PFNMSGGENERIC handler, void * context)
+	{
+		((void (*)(const T &))handler)(*(const T *)context);
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// MQPayload
+	///
+	/// Retrieve the payload of a message posted with Post<T> from the context
+	/// pointer handed to an EventHandler or PFNMSGHANDLER.
+	///
+	/// @context:	TASK
+	/// @scope:     EXPORTED
+	/// @param:     void * context - context passed to the handler
+	/// @return:	const T & - the payload. Valid until the handler returns.
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	template<class T> inline const T & MQPayload(void * context)
+	{
+		return *(const T *)context;
+	}
+
+	//
+	// Compile-time route table (see mqroute.h)
+
+	struct MQROUTETABLE;
+
 	//
 	// Message queue class
 
@@ -50,6 +200,7 @@ namespace Kernel {
 		private:
 
 			friend void ::loop();		// the kernel needs to access the Loop function
+			friend class KernelClass;	// as does the kernel scheduling policy
 
 			/// our internals.
 
@@ -79,11 +230,54 @@ namespace Kernel {
 			/// @scope:     EXPORTED
 			/// @param:     int MaxMessages -  maximum number of messages to process in
 			///             this iteration
-			/// @return:    none
+			/// @return:    int - number of messages processed
+			///
+			//////////////////////////////////////////////////////////////////////////////
+
+			int Loop(int MaxMessages);
+
+			//////////////////////////////////////////////////////////////////////////////
+			/// LoopFor
+			///
+			/// Called by the kernel scheduler. Processes messages until the queue is
+			/// empty or the time budget is spent. The budget is checked between
+			/// messages, so a pass can overrun it by at most one message's handlers.
+			///
+			/// @context:	TASK
+			/// @scope:     EXPORTED
+			/// @param:     unsigned long budget - time budget in microseconds
+			/// @return:    int - number of messages processed
+			///
+			//////////////////////////////////////////////////////////////////////////////
+
+			int LoopFor(unsigned long budget);
+
+			//////////////////////////////////////////////////////////////////////////////
+			/// PostPayload
+			///
+			/// Common implementation of Post and Post<T>: copies size bytes of payload
+			/// into a message slot (or the msgid's coalescing cell).
+			///
+			/// @context:	TASK, INTERRUPT
+			/// @scope:     PRIVATE
+			/// @return:	zero if successfully posted, nonzero if error occurred
 			///
 			//////////////////////////////////////////////////////////////////////////////
 
-			void Loop(int MaxMessages);
+			int PostPayload(int msgid, const void * data, uint8_t size, uint8_t CallerOwns, MQCONTEXT isIntCtx, MQPRIORITY priority);
+
+			//////////////////////////////////////////////////////////////////////////////
+			/// SubscribeTyped
+			///
+			/// Common implementation of Subscribe<T>.
+			///
+			/// @context:	TASK
+			/// @scope:     PRIVATE
+			/// @return:	zero if successfully subscribed, nonzero if error occurred
+			///
+			//////////////////////////////////////////////////////////////////////////////
+
+			int SubscribeTyped(int msgid, PFNMSGGENERIC handler, PFNMSGTHUNK thunk);
 
 		public:
 
@@ -149,6 +343,25 @@ namespace Kernel {
 
 			int Subscribe(int msgid, EventReceiver * handler);
 
+			//////////////////////////////////////////////////////////////////////////////
+			/// Subscribe<T>
+			///
+			/// Subscribe a function taking a typed payload to a given message. The
+			/// message must be posted with Post<T> using the same T.
+			///
+			/// @context:	TASK
+			/// @scope:     EXPORTED
+			/// @param:     int msgid
+			/// @param:     handler - function taking const T &
+			/// @return:	zero if successfully subscribed, nonzero if error occurred
+			///
+			//////////////////////////////////////////////////////////////////////////////
+
+			template<class T> int Subscribe(int msgid, void (* handler)(const T &))
+			{
+				return SubscribeTyped(msgid,(PFNMSGGENERIC)handler,&MQTypedThunk<T>);
+			}
+
 			//////////////////////////////////////////////////////////////////////////////
 			/// Unsubscribe
 			///
@@ -181,6 +394,24 @@ namespace Kernel {
 
 			int Unsubscribe(int msgid, EventReceiver * handler);
 
+			//////////////////////////////////////////////////////////////////////////////
+			/// Unsubscribe<T>
+			///
+			/// Unsubscribe a typed handler subscribed with Subscribe<T>.
+			///
+			/// @context:	TASK
+			/// @scope:     EXPORTED
+			/// @param:     int msgid
+			/// @param:     handler - function taking const T &
+			/// @return:	zero if successfully unsubscribed, nonzero if error occurred
+			///
+			//////////////////////////////////////////////////////////////////////////////
+
+			template<class T> int Unsubscribe(int msgid, void (* handler)(const T &))
+			{
+				return Unsubscribe(msgid,(PFNMSGHANDLER)handler);
+			}
+
 			//////////////////////////////////////////////////////////////////////////////
 			/// UnsubscribeAllIDs
 			///
@@ -198,6 +429,22 @@ namespace Kernel {
 
 			int UnsubscribeAllIDs(EventReceiver * handler);
 
+			//////////////////////////////////////////////////////////////////////////////
+			/// SetStaticRoutes
+			///
+			/// Attach a compile-time route table (see mqroute.h). Routed handlers are
+			/// called before any handlers subscribed at runtime. Pass NULL to detach.
+			///
+			/// @context:	TASK
+			/// @scope:     EXPORTED
+			/// @param:     const MQROUTETABLE * routes - table in flash, built with
+			///             MQ_ROUTE_TABLE
+			/// @return:	none
+			///
+			//////////////////////////////////////////////////////////////////////////////
+
+			void SetStaticRoutes(const MQROUTETABLE * routes);
+
 			//////////////////////////////////////////////////////////////////////////////
 			/// Post
 			///
@@ -210,11 +457,240 @@ namespace Kernel {
 			/// @param:     void * context - pointer to context data
 			/// @param:     boolean CallerOwns - set TRUE if the message queue is not to
 			///	            free the context data when done.
+			/// @param:     MQCONTEXT isIntCtx - context the caller is running in
+			/// @param:     MQPRIORITY priority - lane to post in. Defaults to the
+			///             priority configured for the msgid.
 			/// @return:	zero if successfully posted, nonzero if error occurred
 			///
 			//////////////////////////////////////////////////////////////////////////////
 
-			int Post(int msgid, void * context, MQOWNER CallerOwns, MQCONTEXT isIntCtx);
+			int Post(int msgid, void * context, MQOWNER CallerOwns, MQCONTEXT isIntCtx, MQPRIORITY priority=MQ_PRIORITY_DEFAULT);
+
+			//////////////////////////////////////////////////////////////////////////////
+			/// Post<T>
+			///
+			/// Post a message carrying a copy of a small value. The value is copied
+			/// into the message slot, so the caller keeps nothing alive and no memory
+			/// is allocated. Handlers receive a pointer to the copy: use MQPayload<T>
+			/// in an EventHandler, or subscribe with Subscribe<T>.
+			///
+			/// @context:	TASK, INTERRUPT
+			/// @scope:     EXPORTED
+			/// @param:     int msgid
+			/// @param:     const T & value - trivially copyable, at most
+			///             MSG_PAYLOAD_SIZE bytes
+			/// @param:     MQCONTEXT isIntCtx - context the caller is running in
+			/// @param:     MQPRIORITY priority - lane to post in
+			/// @return:	zero if successfully posted, nonzero if error occurred
+			///
+			//////////////////////////////////////////////////////////////////////////////
+
+			template<class T> int Post(int msgid, const T & value, MQCONTEXT isIntCtx=MQ_CONTEXT_TASK, MQPRIORITY priority=MQ_PRIORITY_DEFAULT)
+			{
+				static_assert(sizeof(T)<=MSG_PAYLOAD_SIZE,"message payload is larger than MSG_PAYLOAD_SIZE");
+				static_assert(__is_trivially_copyable(T),"message payload must be trivially copyable");
+				return PostPayload(msgid,&value,sizeof(T),MQ_OWNER_INLINE,isIntCtx,priority);
+			}
+
+			//////////////////////////////////////////////////////////////////////////////
+			/// PostDelayed
+			///
+			/// Post a message, with a NULL context, once the given delay has passed.
+			/// The message is posted from the timer service interrupt (see
+			/// timerservice.h) within a few microseconds of the delay, and dispatched
+			/// on the next pass of the kernel loop. Uses one of the TIMER_MAX_TIMERS
+			/// timers until it has fired.
+			///
+			/// @context:	TASK
+			/// @scope:     EXPORTED
+			/// @param:     int msgid - message ID to post
+			/// @param:     unsigned long ms - delay in milliseconds
+			/// @return:	zero if successfully scheduled, nonzero if error occurred
+			///
+			//////////////////////////////////////////////////////////////////////////////
+
+			int PostDelayed(int msgid, unsigned long ms);
+
+			//////////////////////////////////////////////////////////////////////////////
+			/// PostPeriodic
+			///
+			/// Post a message, with a NULL context, every period milliseconds until
+			/// cancelled with CancelTimers. The period is kept to a fixed grid, so
+			/// late dispatch does not accumulate drift. Posts that find the queue
+			/// full are lost, as with Post. A zero period is an error.
+			///
+			/// @context:	TASK
+			/// @scope:     EXPORTED
+			/// @param:     int msgid - message ID to post
+			/// @param:     unsigned long period - period in milliseconds
+			/// @return:	zero if successfully scheduled, nonzero if error occurred
+			///
+			//////////////////////////////////////////////////////////////////////////////
+
+			int PostPeriodic(int msgid, unsigned long period);
+
+			//////////////////////////////////////////////////////////////////////////////
+			/// CancelTimers
+			///
+			/// Cancel every delayed and periodic post outstanding for a msgid. A message
+			/// already posted to the queue is not recalled.
+			///
+			/// @context:	TASK
+			/// @scope:     EXPORTED
+			/// @param:     int msgid - message ID
+			/// @return:	int - number of timers cancelled
+			///
+			//////////////////////////////////////////////////////////////////////////////
+
+			int CancelTimers(int msgid);
+
+			//////////////////////////////////////////////////////////////////////////////
+			/// SetPriority
+			///
+			/// Set the priority lane used for a msgid when it is posted with
+			/// MQ_PRIORITY_DEFAULT.
+			///
+			/// @context:	TASK
+			/// @scope:     EXPORTED
+			/// @param:     int msgid
+			/// @param:     MQPRIORITY priority
+			/// @return:	zero if successful, nonzero if error occurred
+			///
+			//////////////////////////////////////////////////////////////////////////////
+
+			int SetPriority(int msgid, MQPRIORITY priority);
+
+			//////////////////////////////////////////////////////////////////////////////
+			/// SetCoalesce
+			///
+			/// Put a msgid into (or take it out of) coalescing mode. A coalesced msgid
+			/// has at most one message pending: posting it again while the earlier post
+			/// is still queued replaces the pending context in place, so only the latest
+			/// value is dispatched. Intended for state-style messages where a stale value
+			/// is worthless. Coalesced msgids must be posted with MQ_OWNER_CALLER, and
+			/// from one context only (task or interrupt, not both).
+			///
+			/// @context:	TASK
+			/// @scope:     EXPORTED
+			/// @param:     int msgid
+			/// @param:     boolean enable
+			/// @return:	zero if successful, nonzero if error occurred (including
+			///             running out of coalescing cells)
+			///
+			//////////////////////////////////////////////////////////////////////////////
+
+			int SetCoalesce(int msgid, boolean enable);
+
+			//////////////////////////////////////////////////////////////////////////////
+			/// GetLaneStats
+			///
+			/// Obtain depth statistics for a priority lane.
+			///
+			/// @context:	TASK
+			/// @scope:     EXPORTED
+			/// @param:     MQPRIORITY lane
+			/// @param:     MQLANESTATS * stats - receives the statistics
+			/// @return:	zero if successful, nonzero if error occurred
+			///
+			//////////////////////////////////////////////////////////////////////////////
+
+			int GetLaneStats(MQPRIORITY lane, MQLANESTATS * stats);
+
+			//////////////////////////////////////////////////////////////////////////////
+			/// GetRejectedCount
+			///
+			/// Returns the number of posts rejected since startup because the ring for
+			/// the posting context was full.
+			///
+			/// @context:	ANY
+			/// @scope:     EXPORTED
+			/// @param:     none
+			/// @return:	unsigned int - count of rejected posts
+			///
+			//////////////////////////////////////////////////////////////////////////////
+
+			unsigned int GetRejectedCount(void);
+
+			//////////////////////////////////////////////////////////////////////////////
+			/// GetDepth
+			///
+			/// Returns the number of messages currently queued across all lanes and
+			/// contexts.
+			///
+			/// @context:	ANY
+			/// @scope:     EXPORTED
+			/// @param:     none
+			/// @return:	unsigned int - messages pending
+			///
+			//////////////////////////////////////////////////////////////////////////////
+
+			unsigned int GetDepth(void);
+
+			#if MQ_STATS
+
+			//////////////////////////////////////////////////////////////////////////////
+			/// GetMsgStats
+			///
+			/// Obtain the instrumentation counters for a msgid.
+			///
+			/// @context:	TASK
+			/// @scope:     EXPORTED
+			/// @param:     int msgid
+			/// @param:     MQMSGSTATS * stats - receives the statistics
+			/// @return:	zero if successful, nonzero if error occurred
+			///
+			//////////////////////////////////////////////////////////////////////////////
+
+			int GetMsgStats(int msgid, MQMSGSTATS * stats);
+
+			//////////////////////////////////////////////////////////////////////////////
+			/// GetQueueStats
+			///
+			/// Obtain the whole-queue instrumentation counters.
+			///
+			/// @context:	TASK
+			/// @scope:     EXPORTED
+			/// @param:     MQQUEUESTATS * stats - receives the statistics
+			/// @return:	none
+			///
+			//////////////////////////////////////////////////////////////////////////////
+
+			void GetQueueStats(MQQUEUESTATS * stats);
+
+			//////////////////////////////////////////////////////////////////////////////
+			/// ResetStats
+			///
+			/// Zero all instrumentation counters.
+			///
+			/// @context:	TASK
+			/// @scope:     EXPORTED
+			/// @param:     none
+			/// @return:	none
+			///
+			//////////////////////////////////////////////////////////////////////////////
+
+			void ResetStats(void);
+
+			//////////////////////////////////////////////////////////////////////////////
+			/// DumpStats
+			///
+			/// Print the instrumentation in a compact CSV-style form:
+			///
+			///		MQ,<highwater>,<dispatched>,<lat worst>,<lat mean>,<handler mean>,<rejected>
+			///		M,<msgid>,<posted>,<dispatched>,<dropped>,<handler worst>,<handler mean>
+			///
+			/// with one M line per msgid that has been posted.
+			///
+			/// @context:	TASK
+			/// @scope:     EXPORTED
+			/// @param:     Print & out - where to print (e.g. Serial)
+			/// @return:	none
+			///
+			//////////////////////////////////////////////////////////////////////////////
+
+			void DumpStats(Print & out);
+
+			#endif
 
 	};
 } // namespace Kernel
@@ -0,0 +1,166 @@
+///////////////////////////////////////////////////////////////////////////////
+/// mqroute.h
+///
+/// Compile-time message routing
+///
+/// Where the subscribers to a message are known at build time, they can be
+/// described as routes rather than subscribed at runtime. Each route is a
+/// function generated from a template specialization, and the per-msgid table
+/// of route functions is built by the compiler and placed in flash. Dispatch
+/// is then a single indirect call per message, with no heap nodes and no list
+/// walk. The runtime Subscribe mechanism remains available alongside it.
+///
+/// Usage (in exactly one translation unit):
+///
+///		MQ_ROUTE(MSG_ID_KEY_PRESSED) {
+///			MQ_ROUTE_TO(display);
+///			MQ_ROUTE_TO_FUNCTION(OnKey);
+///		}
+///
+///		MQ_ROUTE_TABLE(AppRoutes);
+///
+/// and at init time:
+///
+///		Kernel::OS.MessageQueue.SetStaticRoutes(&AppRoutes);
+///
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef _MQROUTE_H_
+#define _MQROUTE_H_
+
+#include "sysincs.h"
+#include "EventReceiver.h"
+#include "mq.h"
+
+namespace Kernel {
+
+	//
+	// Prototype of a generated route function
+
+	typedef void (* PFNMQROUTE)(int msgid, void * context);
+
+	//
+	// The route table: one entry per msgid, NULL where nothing is routed
+
+	typedef struct MQROUTETABLE {
+		PFNMQROUTE	Handler[MSG_MAX_MSG_IDS];
+	} MQROUTETABLE;
+
+	//
+	// Primary template: no route for this id. MQ_ROUTE specializes it.
+
+	template<int ID> struct MQRoute {
+		static const bool Routed=false;
+		static void Deliver(int msgid, void * context) {};
+	};
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// MQRouteToReceiver
+	///
+	/// Deliver a message to an EventReceiver named in a route. The receiver is
+	/// passed as its concrete type and its EventHandler called by qualified
+	/// name, so the call is direct, not through the vtable. A routed class
+	/// that overrides EventHandler must make this a friend, as EventReceiver
+	/// does, since the override is protected.
+	///
+	/// @context: TASK
+	/// @scope: INTERNAL
+	/// @param: T & receiver - the receiving object
+	/// @param: int msgid
+	/// @param: void * context
+	/// @return: none
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	template<class T> inline void MQRouteToReceiver(T & receiver, int msgid, void * context)
+	{
+		receiver.T::EventHandler(msgid,context);
+	}
+
+	//
+	// Table construction. MQRouteEntry yields the route function for an id, or
+	// NULL if there is none; MQRouteSeq generates the id list 0..N-1 so that
+	// MQBuildRoutes can expand one entry per id in a single constant expression.
+
+	template<int ID, bool R=MQRoute<ID>::Routed> struct MQRouteEntry {
+		static constexpr PFNMQROUTE Get(void) { return NULL; };
+	};
+
+	template<int ID> struct MQRouteEntry<ID,true> {
+		static constexpr PFNMQROUTE Get(void) { return &MQRoute<ID>::Deliver; };
+	};
+
+	template<int... IDs> struct MQRouteIds {};
+
+	template<int N, int... IDs> struct MQRouteSeq {
+		typedef typename MQRouteSeq<N-1,N-1,IDs...>::type type;
+	};
+
+	template<int... IDs> struct MQRouteSeq<0,IDs...> {
+		typedef MQRouteIds<IDs...> type;
+	};
+
+	template<int... IDs> constexpr MQROUTETABLE MQBuildRoutes(MQRouteIds<IDs...>)
+	{
+		return MQROUTETABLE{{ MQRouteEntry<IDs>::Get()... }};
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// MQ_ROUTE
+	///
+	/// Open the route for a message id. Follow with a brace-enclosed body of
+	/// MQ_ROUTE_TO / MQ_ROUTE_TO_FUNCTION statements. Within the body the message
+	/// id and context are available as 'msgid' and 'context'.
+	///
+	/// @context: N/A (file scope)
+	/// @param: id - message id, a constant expression less than MSG_MAX_MSG_IDS
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	#define MQ_ROUTE(id) \
+		namespace Kernel { \
+			template<> struct MQRoute<id> { \
+				static const bool Routed=true; \
+				static void Deliver(int msgid, void * context); \
+			}; \
+		} \
+		void Kernel::MQRoute<id>::Deliver(int msgid, void * context)
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// MQ_ROUTE_TO
+	///
+	/// Within an MQ_ROUTE body, deliver to an EventReceiver (or descendent)
+	/// object.
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	#define MQ_ROUTE_TO(receiver) \
+		Kernel::MQRouteToReceiver(receiver,msgid,context)
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// MQ_ROUTE_TO_FUNCTION
+	///
+	/// Within an MQ_ROUTE body, deliver to a PFNMSGHANDLER-style function.
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	#define MQ_ROUTE_TO_FUNCTION(fn) \
+		fn(context)
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// MQ_ROUTE_TABLE
+	///
+	/// Define the flash-resident route table. Must follow every MQ_ROUTE in the
+	/// same translation unit.
+	///
+	/// @param: name - name of the table object
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	#define MQ_ROUTE_TABLE(name) \
+		const Kernel::MQROUTETABLE name PROGMEM = \
+			Kernel::MQBuildRoutes(Kernel::MQRouteSeq<MSG_MAX_MSG_IDS>::type())
+
+}
+
+#endif
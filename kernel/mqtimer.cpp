@@ -0,0 +1,74 @@
+///////////////////////////////////////////////////////////////////////////////
+/// mqtimer.cpp
+///
+/// Delayed and periodic message posting
+///
+/// Delayed and periodic posts are timers of the kernel timer service (see
+/// timerservice.h) that post their msgid from the timer interrupt.
+///
+///////////////////////////////////////////////////////////////////////////////
+
+#include "mq.h"
+#include "timerservice.h"
+
+namespace Kernel {
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// PostDelayed
+	///
+	/// Post a message, with a NULL context, once the given delay has passed.
+	///
+	/// @context:	TASK
+	/// @scope:     EXPORTED
+	/// @param:     int msgid - message ID to post
+	/// @param:     unsigned long ms - delay in milliseconds
+	/// @return:	zero if successfully scheduled, nonzero if error occurred
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	int MQClass::PostDelayed(int msgid, unsigned long ms)
+	{
+		return (TimerService::Get().StartMessage(msgid,ms*1000UL,0)<0)?-1:0;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// PostPeriodic
+	///
+	/// Post a message, with a NULL context, every period milliseconds until
+	/// cancelled with CancelTimers.
+	///
+	/// @context:	TASK
+	/// @scope:     EXPORTED
+	/// @param:     int msgid - message ID to post
+	/// @param:     unsigned long period - period in milliseconds
+	/// @return:	zero if successfully scheduled, nonzero if error occurred
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	int MQClass::PostPeriodic(int msgid, unsigned long period)
+	{
+		int rc=-1;
+		if(period) {
+			period*=1000UL;
+			rc=(TimerService::Get().StartMessage(msgid,period,period)<0)?-1:0;
+		}
+		return rc;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// CancelTimers
+	///
+	/// Cancel every delayed and periodic post outstanding for a msgid.
+	///
+	/// @context:	TASK
+	/// @scope:     EXPORTED
+	/// @param:     int msgid - message ID
+	/// @return:	int - number of timers cancelled
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	int MQClass::CancelTimers(int msgid)
+	{
+		return TimerService::Get().CancelMessage(msgid);
+	}
+}
@@ -10,6 +10,7 @@
 
 #include "ostimer.h"
 #include "Arduino.h"
+#include "timerservice.h"
 
 namespace Kernel {
 
@@ -133,5 +134,246 @@ namespace Kernel {
 		tmr+=(frozen)?(millis()-freeze):0;
 	}
 
+	//
+	// NBT class on the kernel clock
+
+	////////////////////////////////////////////////////////////////////////
+	/// OSTimerUs
+	///
+	/// CONSTRUCTOR
+	///
+	/// Initializes variables for a nonblocking microsecond timer
+	///
+	////////////////////////////////////////////////////////////////////////
+
+	OSTimerUs::OSTimerUs(unsigned long timeout) : time(timeout), freeze(0), frozen(0)
+	{
+		tmr=TimerService::Now();
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	/// Set
+	///
+	/// Set the timeout, in microseconds, and start the timer
+	///
+	/// @context: ANY
+	/// @scope: PUBLIC
+	/// @param: unsigned long timeout
+	/// @return: none
+	///
+	////////////////////////////////////////////////////////////////////////
+
+	void OSTimerUs::Set(unsigned long timeout)
+	{
+		time=timeout;
+		tmr=TimerService::Now();
+		frozen=0;
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	/// Restart
+	///
+	/// Restart the timer to the previously set value
+	///
+	/// @context: ANY
+	/// @scope: PUBLIC
+	/// @param: none
+	/// @return: none
+	///
+	////////////////////////////////////////////////////////////////////////
+
+	void OSTimerUs::Restart(void)
+	{
+		tmr=TimerService::Now();
+		frozen=0;
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	/// isExpired
+	///
+	/// Check if the timer has expired. A frozen timer does not expire.
+	///
+	/// @context: ANY
+	/// @scope: PUBLIC
+	/// @param: none
+	/// @return: int. Nonzero if timer has expired
+	///
+	////////////////////////////////////////////////////////////////////////
+
+	int OSTimerUs::isExpired(void)
+	{
+		return (!frozen && (TimerService::Now()-tmr)>=time);
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	/// Remaining
+	///
+	/// Time left before the timer expires
+	///
+	/// @context: ANY
+	/// @scope: PUBLIC
+	/// @param: none
+	/// @return: unsigned long - microseconds, zero if expired
+	///
+	////////////////////////////////////////////////////////////////////////
+
+	unsigned long OSTimerUs::Remaining(void)
+	{
+		unsigned long elapsed=((frozen)?freeze:TimerService::Now())-tmr;
+		return (elapsed<time)?(time-elapsed):0;
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	/// Freeze
+	///
+	/// Stop a timer from counting
+	///
+	/// @context: ANY
+	/// @scope: PUBLIC
+	/// @param: NONE
+	/// @return: NONE
+	///
+	////////////////////////////////////////////////////////////////////////
+
+	void OSTimerUs::Freeze(void)
+	{
+		if(!frozen) {
+			freeze=TimerService::Now();
+			frozen=1;
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	/// Thaw
+	///
+	/// Resume a frozen timer
+	///
+	/// @context: ANY
+	/// @scope: PUBLIC
+	/// @param: NONE
+	/// @return: NONE
+	///
+	////////////////////////////////////////////////////////////////////////
+
+	void OSTimerUs::Thaw(void)
+	{
+		if(frozen) {
+			tmr+=TimerService::Now()-freeze;
+			frozen=0;
+		}
+	}
+
+	//
+	// Interval measurement
+
+	////////////////////////////////////////////////////////////////////////
+	/// OSStopwatch
+	///
+	/// CONSTRUCTOR
+	///
+	/// Initializes a stopwatch with no samples
+	///
+	////////////////////////////////////////////////////////////////////////
+
+	OSStopwatch::OSStopwatch() : start(0)
+	{
+		Reset();
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	/// Start
+	///
+	/// Start timing an interval
+	///
+	/// @context: ANY
+	/// @scope: PUBLIC
+	/// @param: none
+	/// @return: none
+	///
+	////////////////////////////////////////////////////////////////////////
+
+	void OSStopwatch::Start(void)
+	{
+		start=TimerService::Now();
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	/// Stop
+	///
+	/// End the interval begun by Start and add it to the statistics
+	///
+	/// @context: ANY
+	/// @scope: PUBLIC
+	/// @param: none
+	/// @return: unsigned long - the interval in microseconds
+	///
+	////////////////////////////////////////////////////////////////////////
+
+	unsigned long OSStopwatch::Stop(void)
+	{
+		Last=TimerService::Now()-start;
+		Count++;
+		Total+=Last;
+		if(Last>Worst) {
+			Worst=Last;
+		}
+		if(Last<Best) {
+			Best=Last;
+		}
+		return Last;
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	/// Elapsed
+	///
+	/// Time since Start, without ending the interval
+	///
+	/// @context: ANY
+	/// @scope: PUBLIC
+	/// @param: none
+	/// @return: unsigned long - microseconds
+	///
+	////////////////////////////////////////////////////////////////////////
+
+	unsigned long OSStopwatch::Elapsed(void)
+	{
+		return TimerService::Now()-start;
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	/// Mean
+	///
+	/// Mean of the intervals measured so far
+	///
+	/// @context: ANY
+	/// @scope: PUBLIC
+	/// @param: none
+	/// @return: unsigned long - microseconds, zero with no samples
+	///
+	////////////////////////////////////////////////////////////////////////
+
+	unsigned long OSStopwatch::Mean(void)
+	{
+		return (Count)?(Total/Count):0;
+	}
+
+	////////////////////////////////////////////////////////////////////////
+	/// Reset
+	///
+	/// Discard the statistics
+	///
+	/// @context: ANY
+	/// @scope: PUBLIC
+	/// @param: none
+	/// @return: none
+	///
+	////////////////////////////////////////////////////////////////////////
+
+	void OSStopwatch::Reset(void)
+	{
+		Count=Last=Worst=Total=0;
+		Best=0xffffffffUL;
+	}
+
 }
 
@@ -121,6 +121,217 @@ namespace Kernel {
 			void Thaw(void);
 
 	};
+
+	//
+	// NBT class on the kernel clock: as OSTimer, with the timeout in
+	// microseconds (TimerService::Now, TIMER_TICK_US resolution). Timeouts up to
+	// about 71 minutes.
+
+	class OSTimerUs {
+
+		private:
+
+			unsigned long tmr,time,freeze;
+			unsigned char frozen;
+
+		public:
+
+			////////////////////////////////////////////////////////////////////////
+			/// OSTimerUs
+			///
+			/// CONSTRUCTOR
+			///
+			/// Initializes variables for a nonblocking microsecond timer
+			///
+			////////////////////////////////////////////////////////////////////////
+
+			OSTimerUs(unsigned long timeout=0);
+
+			////////////////////////////////////////////////////////////////////////
+			/// Set
+			///
+			/// Set the timeout, in microseconds, and start the timer
+			///
+			/// @context: ANY
+			/// @scope: PUBLIC
+			/// @param: unsigned long timeout
+			/// @return: none
+			///
+			////////////////////////////////////////////////////////////////////////
+
+			void Set(unsigned long timeout);
+
+			////////////////////////////////////////////////////////////////////////
+			/// Restart
+			///
+			/// Restart the timer to the previously set value
+			///
+			/// @context: ANY
+			/// @scope: PUBLIC
+			/// @param: none
+			/// @return: none
+			///
+			////////////////////////////////////////////////////////////////////////
+
+			void Restart(void);
+
+			////////////////////////////////////////////////////////////////////////
+			/// isExpired
+			///
+			/// Check if the timer has expired. A frozen timer does not expire.
+			///
+			/// @context: ANY
+			/// @scope: PUBLIC
+			/// @param: none
+			/// @return: int. Nonzero if timer has expired
+			///
+			////////////////////////////////////////////////////////////////////////
+
+			int isExpired(void);
+
+			////////////////////////////////////////////////////////////////////////
+			/// Remaining
+			///
+			/// Time left before the timer expires
+			///
+			/// @context: ANY
+			/// @scope: PUBLIC
+			/// @param: none
+			/// @return: unsigned long - microseconds, zero if expired
+			///
+			////////////////////////////////////////////////////////////////////////
+
+			unsigned long Remaining(void);
+
+			////////////////////////////////////////////////////////////////////////
+			/// Freeze
+			///
+			/// Stop a timer from counting
+			///
+			/// @context: ANY
+			/// @scope: PUBLIC
+			/// @param: NONE
+			/// @return: NONE
+			///
+			////////////////////////////////////////////////////////////////////////
+
+			void Freeze(void);
+
+			////////////////////////////////////////////////////////////////////////
+			/// Thaw
+			///
+			/// Resume a frozen timer
+			///
+			/// @context: ANY
+			/// @scope: PUBLIC
+			/// @param: NONE
+			/// @return: NONE
+			///
+			////////////////////////////////////////////////////////////////////////
+
+			void Thaw(void);
+	};
+
+	//
+	// Interval measurement on the kernel clock. Bracket the code to measure
+	// with Start and Stop; each Stop adds one sample to the statistics. All
+	// times are in microseconds.
+
+	class OSStopwatch {
+
+		private:
+
+			unsigned long start;
+
+		public:
+
+			unsigned long	Count;		// samples taken
+			unsigned long	Last;		// the most recent interval
+			unsigned long	Worst;		// the longest interval
+			unsigned long	Best;		// the shortest interval
+			unsigned long	Total;		// sum of all intervals (wraps after ~71 min)
+
+			////////////////////////////////////////////////////////////////////////
+			/// OSStopwatch
+			///
+			/// CONSTRUCTOR
+			///
+			/// Initializes a stopwatch with no samples
+			///
+			////////////////////////////////////////////////////////////////////////
+
+			OSStopwatch();
+
+			////////////////////////////////////////////////////////////////////////
+			/// Start
+			///
+			/// Start timing an interval
+			///
+			/// @context: ANY
+			/// @scope: PUBLIC
+			/// @param: none
+			/// @return: none
+			///
+			////////////////////////////////////////////////////////////////////////
+
+			void Start(void);
+
+			////////////////////////////////////////////////////////////////////////
+			/// Stop
+			///
+			/// End the interval begun by Start and add it to the statistics
+			///
+			/// @context: ANY
+			/// @scope: PUBLIC
+			/// @param: none
+			/// @return: unsigned long - the interval in microseconds
+			///
+			////////////////////////////////////////////////////////////////////////
+
+			unsigned long Stop(void);
+
+			////////////////////////////////////////////////////////////////////////
+			/// Elapsed
+			///
+			/// Time since Start, without ending the interval
+			///
+			/// @context: ANY
+			/// @scope: PUBLIC
+			/// @param: none
+			/// @return: unsigned long - microseconds
+			///
+			////////////////////////////////////////////////////////////////////////
+
+			unsigned long Elapsed(void);
+
+			////////////////////////////////////////////////////////////////////////
+			/// Mean
+			///
+			/// Mean of the intervals measured so far
+			///
+			/// @context: ANY
+			/// @scope: PUBLIC
+			/// @param: none
+			/// @return: unsigned long - microseconds, zero with no samples
+			///
+			////////////////////////////////////////////////////////////////////////
+
+			unsigned long Mean(void);
+
+			////////////////////////////////////////////////////////////////////////
+			/// Reset
+			///
+			/// Discard the statistics
+			///
+			/// @context: ANY
+			/// @scope: PUBLIC
+			/// @param: none
+			/// @return: none
+			///
+			////////////////////////////////////////////////////////////////////////
+
+			void Reset(void);
+	};
 }
 
 #endif
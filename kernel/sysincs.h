@@ -21,6 +21,29 @@
 #define IMIN(a,b) (((a)<(b))?(a):(b))
 #define IMAX(a,b) (((a)>(b))?(a):(b))
 
+// Kernel RAM report. Build with KERNEL_RAM_REPORT set to 1 and each kernel
+// module reports the static RAM it takes as a compiler warning, e.g.
+//
+//   warning: 'void Kernel::KERNELRAM() [with T = KernelRam::TaskRing;
+//            unsigned int BYTES = 54]' is deprecated: kernel RAM report
+//
+// The figures are sizeof() the module's statics, so they follow the
+// configuration the kernel is built with. Heap use is not included.
+
+#ifndef KERNEL_RAM_REPORT
+#define KERNEL_RAM_REPORT	0
+#endif
+
+#if KERNEL_RAM_REPORT
+namespace Kernel {
+	template<class T, unsigned int BYTES> __attribute__((deprecated("kernel RAM report"))) inline void KERNELRAM(void) {}
+}
+#define KERNEL_RAM(tag,bytes)	namespace KernelRam { struct tag; } inline void KernelRam##tag(void) { Kernel::KERNELRAM<KernelRam::tag,(bytes)>(); }
+#else
+#define KERNEL_RAM(tag,bytes)
+#endif
+
+extern "C" void setup();
 extern "C" void loop();
 
 #endif
@@ -8,48 +8,58 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #include "taskring.h"
+#include "timerservice.h"
 #include <stdlib.h>
-
-#define TR_TASKTYPE_FCTN	0
-#define TR_TASKTYPE_CLASS	1
+#include <limits.h>
 
 //
 // task ring internals
 
 namespace Kernel {
 
-	// Task state structure
+	// Node operations. A node is dispatched on its TASKNODE_FUNCTION flag:
+	// function tasks are always ready and run at the default priority, Task
+	// nodes defer to their Task.
 
-	typedef class TASKSTATE * 	PTASKSTATE;
-	class TASKSTATE {
+	class TASKNODEOPS {
 		public:
-			void *				handler;
-			uint8_t				type;
-			union {
-				PFNTASKHANDLER		fHandler;
-			} pointers;
-			void *				context;
-			PTASKSTATE			pNext;
-			TASKSTATE() : pNext(NULL) {};
-			virtual ~TASKSTATE() {};
-			virtual void Call()=0;
+			static Task * TaskOf(PTASKNODE pNode) { return (Task *)pNode->Owner; };
+			static void Call(PTASKNODE pNode);
+			static boolean Ready(PTASKNODE pNode, unsigned long now) {
+				return (pNode->Flags & TASKNODE_FUNCTION) || TaskOf(pNode)->IsReady(now);
+			};
+			static uint8_t Priority(PTASKNODE pNode) {
+				return (pNode->Flags & TASKNODE_FUNCTION)?TASK_PRIORITY_DEFAULT:TaskOf(pNode)->Priority;
+			};
+			static long Slack(PTASKNODE pNode, unsigned long now) {
+				return (pNode->Flags & TASKNODE_FUNCTION)?LONG_MAX:TaskOf(pNode)->Slack(now);
+			};
+			static void Notify(PTASKNODE pNode, uint32_t msgbit) {
+				if(!(pNode->Flags & TASKNODE_FUNCTION) && (TaskOf(pNode)->WakeMsgs & msgbit)) {
+					TaskOf(pNode)->Signal(TASK_EVENT_MESSAGE);
+				}
+			};
+			static boolean Pending(PTASKNODE pNode) {
+				return (pNode->Flags & TASKNODE_FUNCTION) || TaskOf(pNode)->Polled || TaskOf(pNode)->Events;
+			};
+			static void PrintName(PTASKNODE pNode, Print & out);
+			#if TASK_WATCHDOG
+			static void Ran(PTASKNODE pNode, unsigned long elapsed) {
+				if(!(pNode->Flags & TASKNODE_FUNCTION) && TaskOf(pNode)->WatchRun &&
+				   (elapsed>TaskOf(pNode)->WatchRun*1000UL)) {
+					pNode->Flags|=TASKNODE_OVERRUN;
+				}
+			};
+			#endif
 	};
 
-	typedef class TASKSTATE_C	PTASKSTATE_C;
-	class TASKSTATE_C : public TASKSTATE {
-		public:
-			Task *				Handler;
-			TASKSTATE_C(Task * handler) : Handler(handler) {};
-			void Call() { Handler->TaskLoop(); };
-	};
+	// Function task registration: the node, followed by the function's context
 
-	typedef class TASKSTATE_F	PTASKSTATE_F;
-	class TASKSTATE_F : public TASKSTATE {
+	typedef class TASKFUNCTION *	PTASKFUNCTION;
+	class TASKFUNCTION {
 		public:
-			PFNTASKHANDLER	Handler;
+			TASKNODE		Node;			// must be first
 			void *			context;
-			TASKSTATE_F(PFNTASKHANDLER handler, void * context) : Handler(handler),context(context) {};
-			void Call() { Handler(context); };
 	};
 
 	// Task internal structure
@@ -57,11 +67,115 @@ namespace Kernel {
 	typedef class TASKINTERNALS *	PTASKINTERNALS;
 	class TASKINTERNALS {
 		public:
-			PTASKSTATE	pHead;
-			PTASKSTATE	pCur;
-			TASKINTERNALS() : pHead(NULL),pCur(NULL) {};
+			PTASKNODE		pHead;
+			PTASKNODE		pCur;
+			PTASKNODE volatile pRunning;	// task being called, NULL between calls (read by the WDT interrupt)
+			#if TASK_MAX_FUNCTIONS
+			TASKFUNCTION	Functions[TASK_MAX_FUNCTIONS];
+			#endif
 	};
 
+	// the single internals block. Static, so it is zeroed by the C runtime.
+
+	static TASKINTERNALS taskInternals;
+
+	KERNEL_RAM(TaskRing,sizeof(TASKINTERNALS));
+	KERNEL_RAM(PerTask,sizeof(Task));
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// Call
+	///
+	/// Run the task a node belongs to.
+	///
+	/// @scope:	  PRIVATE
+	/// @context: TASK
+	/// @param:   PTASKNODE pNode
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TASKNODEOPS::Call(PTASKNODE pNode)
+	{
+		if(pNode->Flags & TASKNODE_FUNCTION) {
+			((PFNTASKHANDLER)pNode->Owner)(((PTASKFUNCTION)pNode)->context);
+		} else {
+			TaskOf(pNode)->Run();
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// PrintName
+	///
+	/// Print the name of the task a node belongs to: the Task's SetName name, or
+	/// the address of the Task or function in hex.
+	///
+	/// @scope:	  PRIVATE
+	/// @context: TASK
+	/// @param:   PTASKNODE pNode
+	/// @param:   Print & out
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TASKNODEOPS::PrintName(PTASKNODE pNode, Print & out)
+	{
+		if(!(pNode->Flags & TASKNODE_FUNCTION) && TaskOf(pNode)->Name) {
+			out.print(TaskOf(pNode)->Name);
+		} else {
+			out.print((unsigned long)pNode->Owner,HEX);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// Link
+	///
+	/// Add a task to the head of the ready list.
+	///
+	/// @scope:	  PRIVATE
+	/// @context: TASK
+	/// @param:   PTASKINTERNALS internal
+	/// @param:   PTASKNODE pTask
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	static void Link(PTASKINTERNALS internal, PTASKNODE pTask)
+	{
+		pTask->pPrev=NULL;
+		pTask->pNext=internal->pHead;
+		if(internal->pHead) {
+			internal->pHead->pPrev=pTask;
+		}
+		internal->pHead=pTask;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// Unlink
+	///
+	/// Remove a task from the ready list. If it was due to be visited next, the
+	/// scheduler moves on to its successor.
+	///
+	/// @scope:	  PRIVATE
+	/// @context: TASK
+	/// @param:   PTASKINTERNALS internal
+	/// @param:   PTASKNODE pTask
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	static void Unlink(PTASKINTERNALS internal, PTASKNODE pTask)
+	{
+		if(internal->pCur==pTask) {
+			internal->pCur=pTask->pNext;
+		}
+		if(pTask->pPrev) {
+			pTask->pPrev->pNext=pTask->pNext;
+		} else {
+			internal->pHead=pTask->pNext;
+		}
+		if(pTask->pNext) {
+			pTask->pNext->pPrev=pTask->pPrev;
+		}
+		pTask->pNext=NULL;
+		pTask->pPrev=NULL;
+	}
+
 	///////////////////////////////////////////////////////////////////////////////
 	/// TASKRing
 	///
@@ -79,7 +193,7 @@ namespace Kernel {
 
 	TaskRing::TaskRing(void)
 	{
-		this->internals=new TASKINTERNALS;
+		this->internals=&taskInternals;
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -103,25 +217,121 @@ namespace Kernel {
 	///////////////////////////////////////////////////////////////////////////////
 	/// Loop
 	///
-	/// Called by the kernel at task time to sequentially call the handlers.
+	/// Called by the kernel at task time to call the handlers. Each call runs
+	/// one ready task: the most urgent priority first, then the earliest
+	/// deadline (see Task.h), with ties going to the next in ring order so equal
+	/// tasks take turns. Tasks waiting on a wake source are skipped, and if
+	/// nothing is ready nothing is run.
 	///
 	/// @scope:	  EXPORTED
 	/// @context: TASK
 	/// @param:   none
+	/// @return:  boolean - true if a task was run
 	///
 	///////////////////////////////////////////////////////////////////////////////
 
-	void TaskRing::Loop(void)
+	boolean TaskRing::Loop(void)
 	{
 		PTASKINTERNALS internal=(PTASKINTERNALS)(this->internals);
+		PTASKNODE pStart;
+		PTASKNODE pTask;
+		PTASKNODE pBest=NULL;
+		uint8_t bestPriority=0;
+		long bestSlack=0;
+		unsigned long now=TimerService::Now();
 
 		if(internal->pCur==NULL) {
 			internal->pCur=internal->pHead;
 		}
 
-		if(internal->pCur) {
-			internal->pCur->Call();					// dispatch to the task handler
-			internal->pCur=internal->pCur->pNext;
+		// every task is asked, so periodic releases (and misses) are accounted on
+		// time even when a more urgent task wins the pass
+
+		pStart=pTask=internal->pCur;
+		while(pTask) {
+			PTASKNODE pNext=pTask->pNext?pTask->pNext:internal->pHead;
+			if(TASKNODEOPS::Ready(pTask,now)) {
+				uint8_t priority=TASKNODEOPS::Priority(pTask);
+				long slack=TASKNODEOPS::Slack(pTask,now);
+				if(!pBest || (priority<bestPriority) || ((priority==bestPriority) && (slack<bestSlack))) {
+					pBest=pTask;
+					bestPriority=priority;
+					bestSlack=slack;
+				}
+			}
+			pTask=(pNext==pStart)?NULL:pNext;
+		}
+
+		if(pBest) {
+			internal->pCur=pBest->pNext;
+			internal->pRunning=pBest;
+			#if TASK_PROFILE || TASK_WATCHDOG
+			unsigned long start=TimerService::Now();
+			TASKNODEOPS::Call(pBest);				// dispatch to the task handler
+			unsigned long elapsed=TimerService::Now()-start;
+			#if TASK_PROFILE
+			pBest->Profile.Calls++;
+			pBest->Profile.Total+=elapsed;
+			pBest->Profile.Last=elapsed;
+			if(elapsed>pBest->Profile.Worst) {
+				pBest->Profile.Worst=elapsed;
+			}
+			#endif
+			#if TASK_WATCHDOG
+			TASKNODEOPS::Ran(pBest,elapsed);
+			#endif
+			#else
+			TASKNODEOPS::Call(pBest);				// dispatch to the task handler
+			#endif
+			internal->pRunning=NULL;
+		}
+		return (pBest!=NULL);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// AnyPending
+	///
+	/// Check whether any task on the ready list has work pending.
+	///
+	/// @scope:	  PRIVATE
+	/// @context: TASK
+	/// @param:   none
+	/// @return:  boolean - true if a task has work pending
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	boolean TaskRing::AnyPending(void)
+	{
+		PTASKINTERNALS internal=(PTASKINTERNALS)(this->internals);
+		for(PTASKNODE pTask=internal->pHead;pTask;pTask=pTask->pNext) {
+			if(TASKNODEOPS::Pending(pTask)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// NotifyMessage
+	///
+	/// Called by the message queue once a message has been dispatched. Raises
+	/// TASK_EVENT_MESSAGE on every task waiting for this msgid.
+	///
+	/// @scope:	  PRIVATE
+	/// @context: TASK
+	/// @param:   int msgid
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TaskRing::NotifyMessage(int msgid)
+	{
+		PTASKINTERNALS internal=(PTASKINTERNALS)(this->internals);
+
+		if(msgid<32) {
+			uint32_t msgbit=(1UL<<msgid);
+			for(PTASKNODE pTask=internal->pHead;pTask;pTask=pTask->pNext) {
+				TASKNODEOPS::Notify(pTask,msgbit);
+			}
 		}
 	}
 
@@ -144,15 +354,22 @@ namespace Kernel {
 	int TaskRing::RegisterTaskHandler(PFNTASKHANDLER handler, void * context)
 	{
 		int rc=-1;
+		#if TASK_MAX_FUNCTIONS
 		if(handler) {
-			PTASKSTATE pNew = new TASKSTATE_F((void *)handler,context);
 			PTASKINTERNALS internal=(PTASKINTERNALS)(this->internals);
-			if(pNew) {
-				pNew->pNext=internal->pHead;
-				internal->pHead=pNew;
-				rc=0;
+			for(uint8_t idx=0;idx<TASK_MAX_FUNCTIONS;idx++) {
+				PTASKFUNCTION pNew=&internal->Functions[idx];
+				if(!pNew->Node.Owner) {
+					pNew->Node.Owner=(void *)handler;
+					pNew->Node.Flags=TASKNODE_FUNCTION;
+					pNew->context=context;
+					Link(internal,&pNew->Node);
+					rc=0;
+					break;
+				}
 			}
 		}
+		#endif
 		return rc;
 	}
 
@@ -172,14 +389,19 @@ namespace Kernel {
 	int TaskRing::RegisterTaskHandler(Task * task)
 	{
 		int rc=-1;
-		if(task) {
-			PTASKSTATE pNew = new TASKSTATE_C(task);
-			PTASKINTERNALS internal=(PTASKINTERNALS)(this->internals);
-			if(pNew) {
-				pNew->pNext=internal->pHead;
-				internal->pHead=pNew;
-				rc=0;
+		if(task && !task->Node.Owner) {
+			task->Node.Owner=task;
+			task->Node.Flags=0;
+			#if TASK_WATCHDOG
+			task->Heartbeat();
+			#endif
+			#if TASK_PROFILE
+			memset(&task->Node.Profile,0,sizeof(task->Node.Profile));
+			#endif
+			if(!task->Suspended) {
+				Link((PTASKINTERNALS)(this->internals),&task->Node);
 			}
+			rc=0;
 		}
 		return rc;
 	}
@@ -188,13 +410,251 @@ namespace Kernel {
 	/// DeregisterTaskHandler
 	///
 	/// Passed a pointer to a task class, will deregister this task from the task
-	/// manager. Essential if Task classes are dynamically destroyed.
+	/// manager. Essential if Task classes are dynamically destroyed. The task
+	/// carries its own registration, so this is O(1).
+	///
+	/// @scope: EXPORTED
+	/// @context: TASK
+	/// @param:   Task * task
+	/// @return:  zero if successful, nonzero if the task was not registered
 	///
 	///////////////////////////////////////////////////////////////////////////////
 
 	int TaskRing::DeregisterTaskHandler(Task * task)
 	{
+		int rc=-1;
+		if(task && task->Node.Owner) {
+			if(!task->Suspended) {
+				Unlink((PTASKINTERNALS)(this->internals),&task->Node);
+			}
+			task->Node.Owner=NULL;
+			rc=0;
+		}
+		return rc;
+	}
 
+	///////////////////////////////////////////////////////////////////////////////
+	/// SuspendTaskHandler
+	///
+	/// Take a task off the ready list. It keeps its registration, and any events
+	/// signalled meanwhile, but costs nothing per scheduler pass until resumed.
+	/// A task may suspend itself from its own TaskLoop.
+	///
+	/// @scope: EXPORTED
+	/// @context: TASK
+	/// @param:   Task * task
+	/// @return:  zero if successful, nonzero if it was already suspended
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	int TaskRing::SuspendTaskHandler(Task * task)
+	{
+		int rc=-1;
+		if(task && !task->Suspended) {
+			if(task->Node.Owner) {
+				Unlink((PTASKINTERNALS)(this->internals),&task->Node);
+			}
+			task->Suspended=true;
+			rc=0;
+		}
+		return rc;
 	}
 
+	///////////////////////////////////////////////////////////////////////////////
+	/// ResumeTaskHandler
+	///
+	/// Put a suspended task back on the ready list.
+	///
+	/// @scope: EXPORTED
+	/// @context: TASK
+	/// @param:   Task * task
+	/// @return:  zero if successful, nonzero if it was not suspended
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	int TaskRing::ResumeTaskHandler(Task * task)
+	{
+		int rc=-1;
+		if(task && task->Suspended) {
+			if(task->Node.Owner) {
+				Link((PTASKINTERNALS)(this->internals),&task->Node);
+			}
+			#if TASK_WATCHDOG
+			task->Heartbeat();						// not starved while suspended
+			#endif
+			task->Suspended=false;
+			rc=0;
+		}
+		return rc;
+	}
+
+	#if TASK_WATCHDOG
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// Watch
+	///
+	/// Check the watched tasks on the ready list. Overruns since the last check
+	/// are reported, one line each
+	///
+	///		WD,OVERRUN,<name>
+	///
+	/// and the first task found to have missed its heartbeat is returned.
+	/// Suspended tasks are not on the ready list, so are never starved.
+	///
+	/// @scope:	  PRIVATE
+	/// @context: TASK
+	/// @param:   unsigned long now - millis()
+	/// @param:   Print * log - where to report, NULL for nowhere
+	/// @return:  PTASKNODE - a starved task, or NULL if none
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	PTASKNODE TaskRing::Watch(unsigned long now, Print * log)
+	{
+		PTASKINTERNALS internal=(PTASKINTERNALS)(this->internals);
+		PTASKNODE pStarved=NULL;
+
+		for(PTASKNODE pTask=internal->pHead;pTask;pTask=pTask->pNext) {
+			if(pTask->Flags & TASKNODE_OVERRUN) {
+				pTask->Flags&=~TASKNODE_OVERRUN;
+				if(log) {
+					log->print(F("WD,OVERRUN,"));
+					TASKNODEOPS::PrintName(pTask,*log);
+					log->println();
+				}
+			}
+			if(!pStarved && !(pTask->Flags & TASKNODE_FUNCTION)) {
+				Task * task=TASKNODEOPS::TaskOf(pTask);
+				if(task->WatchBeat && ((now-task->LastBeat)>task->WatchBeat)) {
+					pStarved=pTask;
+				}
+			}
+		}
+		return pStarved;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// Running
+	///
+	/// The task being called, if any. Used by the watchdog interrupt to name the
+	/// task that has hung.
+	///
+	/// @scope:	  PRIVATE
+	/// @context: ANY
+	/// @param:   none
+	/// @return:  PTASKNODE - the task, or NULL if none is running
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	PTASKNODE TaskRing::Running(void)
+	{
+		return ((PTASKINTERNALS)(this->internals))->pRunning;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// GetName
+	///
+	/// Copy the SetName name of a Task into a buffer, for the reset record.
+	/// The copy is not terminated if it fills the buffer. Function tasks, and
+	/// Tasks without a name, give an empty string.
+	///
+	/// @scope:	  PRIVATE
+	/// @context: ANY
+	/// @param:   PTASKNODE pNode - may be NULL
+	/// @param:   char * buf
+	/// @param:   uint8_t len - size of buf
+	/// @return:  none
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TaskRing::GetName(PTASKNODE pNode, char * buf, uint8_t len)
+	{
+		const char * name=NULL;
+		memset(buf,0,len);
+		if(pNode && !(pNode->Flags & TASKNODE_FUNCTION)) {
+			name=TASKNODEOPS::TaskOf(pNode)->Name;
+		}
+		if(name) {
+			strncpy(buf,name,len);
+		}
+	}
+
+	#endif
+
+	#if TASK_PROFILE
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// GetTaskProfile
+	///
+	/// Obtain the CPU time profile of a registered task.
+	///
+	/// @scope: EXPORTED
+	/// @context: TASK
+	/// @param:   Task * task
+	/// @param:   TASKPROFILE * profile - receives the profile
+	/// @return:  zero if successful, nonzero if the task is not registered
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	int TaskRing::GetTaskProfile(Task * task, TASKPROFILE * profile)
+	{
+		int rc=-1;
+		if(task && task->Node.Owner && profile) {
+			*profile=task->Node.Profile;
+			rc=0;
+		}
+		return rc;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// ResetProfile
+	///
+	/// Zero the profile of every task on the ready list.
+	///
+	/// @scope: EXPORTED
+	/// @context: TASK
+	/// @param:   none
+	/// @return:  none
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TaskRing::ResetProfile(void)
+	{
+		PTASKINTERNALS internal=(PTASKINTERNALS)(this->internals);
+		for(PTASKNODE pTask=internal->pHead;pTask;pTask=pTask->pNext) {
+			memset(&pTask->Profile,0,sizeof(pTask->Profile));
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// DumpProfile
+	///
+	/// Print the profile of every task on the ready list (see taskring.h).
+	///
+	/// @scope: EXPORTED
+	/// @context: TASK
+	/// @param:   Print & out - where to print (e.g. Serial)
+	/// @return:  none
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TaskRing::DumpProfile(Print & out)
+	{
+		PTASKINTERNALS internal=(PTASKINTERNALS)(this->internals);
+		for(PTASKNODE pTask=internal->pHead;pTask;pTask=pTask->pNext) {
+			out.print(F("TP,"));
+			TASKNODEOPS::PrintName(pTask,out);
+			out.print(',');
+			out.print(pTask->Profile.Calls);
+			out.print(',');
+			out.print(pTask->Profile.Total);
+			out.print(',');
+			out.print(pTask->Profile.Worst);
+			out.print(',');
+			out.println(pTask->Profile.Last);
+		}
+	}
+
+	#endif
+
 }
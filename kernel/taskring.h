@@ -15,6 +15,15 @@
 
 typedef void (*PFNTASKHANDLER)(void * context);
 
+//
+// Function tasks (RegisterTaskHandler with a function) take their
+// registration from a static pool of TASK_MAX_FUNCTIONS entries. Task classes
+// carry their own, so need none.
+
+#ifndef TASK_MAX_FUNCTIONS
+#define TASK_MAX_FUNCTIONS	2
+#endif
+
 // the Arduino 'loop' function is declared with 'C' linkage, not C++
 
 namespace Kernel {
@@ -24,6 +33,8 @@ namespace Kernel {
 		private:
 
 			friend void ::loop();		// the kernel needs to access the Loop function
+			friend class MQClass;		// the message queue wakes tasks waiting on a msgid
+			friend class KernelClass;	// the kernel checks for pending work before sleeping
 
 			// internals
 
@@ -54,10 +65,91 @@ namespace Kernel {
 			/// @scope:	  EXPORTED
 			/// @context: TASK
 			/// @param:   none
+			/// @return:  boolean - true if a task was run
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			boolean Loop(void);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// AnyPending
+			///
+			/// Check whether any task on the ready list has work pending (events, or is
+			/// polled). Used by the kernel, with interrupts masked, to decide whether
+			/// it may sleep.
+			///
+			/// @scope:	  PRIVATE
+			/// @context: TASK
+			/// @param:   none
+			/// @return:  boolean - true if a task has work pending
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			boolean AnyPending(void);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// NotifyMessage
+			///
+			/// Called by the message queue once a message has been dispatched. Wakes
+			/// every task that asked for this msgid with Task::WakeOnMessage.
+			///
+			/// @scope:	  PRIVATE
+			/// @context: TASK
+			/// @param:   int msgid
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void NotifyMessage(int msgid);
+
+			#if TASK_WATCHDOG
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// Watch
+			///
+			/// Check the tasks under the watchdog (see Task::Watch). Reports overruns to
+			/// the log and returns the first task that has missed its heartbeat.
+			///
+			/// @scope:	  PRIVATE
+			/// @context: TASK
+			/// @param:   unsigned long now - millis()
+			/// @param:   Print * log - where to report, NULL for nowhere
+			/// @return:  PTASKNODE - a starved task, or NULL if none
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			PTASKNODE Watch(unsigned long now, Print * log);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// Running
+			///
+			/// The task being called, if any.
+			///
+			/// @scope:	  PRIVATE
+			/// @context: ANY
+			/// @param:   none
+			/// @return:  PTASKNODE - the task, or NULL if none is running
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			PTASKNODE Running(void);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// GetName
+			///
+			/// Copy the name of a task into a buffer, unterminated if it fills it.
+			///
+			/// @scope:	  PRIVATE
+			/// @context: ANY
+			/// @param:   PTASKNODE pNode - may be NULL
+			/// @param:   char * buf
+			/// @param:   uint8_t len - size of buf
+			/// @return:  none
 			///
 			///////////////////////////////////////////////////////////////////////////////
 
-			void Loop(void);
+			void GetName(PTASKNODE pNode, char * buf, uint8_t len);
+
+			#endif
 
 		public:
 
@@ -82,12 +174,13 @@ namespace Kernel {
 			/// will register this function to be called by the scheduler at task time. At
 			/// all times the context data is 'owned' by the caller
 			/// Can block, but will block other tasks. Should not be called in interrupt
-			/// context.
+			/// context. Fails once TASK_MAX_FUNCTIONS functions are registered.
 			///
 			/// @scope:   EXPORTED
 			/// @context: TASK
 			/// @param:   PFNHANDLER pfnHandler
 			/// @param:   (void *) context
+			/// @return:  zero if successful, nonzero if error occurred
 			///
 			///////////////////////////////////////////////////////////////////////////////
 
@@ -112,12 +205,98 @@ namespace Kernel {
 			/// DeregisterTaskHandler
 			///
 			/// Passed a pointer to a task class, will deregister this task from the task
-			/// manager. Essential if Task classes are dynamically destroyed.
+			/// manager. Essential if Task classes are dynamically destroyed. O(1).
+			///
+			/// @scope: EXPORTED
+			/// @context: TASK
+			/// @param:   Task * task
+			/// @return:  zero if successful, nonzero if the task was not registered
 			///
 			///////////////////////////////////////////////////////////////////////////////
 
 			int DeregisterTaskHandler(Task * task);
 
+			///////////////////////////////////////////////////////////////////////////////
+			/// SuspendTaskHandler
+			///
+			/// Take a task off the ready list until ResumeTaskHandler. A suspended task
+			/// is not visited by the scheduler at all. O(1). See also Task::Suspend.
+			///
+			/// @scope: EXPORTED
+			/// @context: TASK
+			/// @param:   Task * task
+			/// @return:  zero if successful, nonzero if it was already suspended
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			int SuspendTaskHandler(Task * task);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// ResumeTaskHandler
+			///
+			/// Put a suspended task back on the ready list. O(1). See also Task::Resume.
+			///
+			/// @scope: EXPORTED
+			/// @context: TASK
+			/// @param:   Task * task
+			/// @return:  zero if successful, nonzero if it was not suspended
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			int ResumeTaskHandler(Task * task);
+
+			#if TASK_PROFILE
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// GetTaskProfile
+			///
+			/// Obtain the CPU time profile of a registered task.
+			///
+			/// @scope: EXPORTED
+			/// @context: TASK
+			/// @param:   Task * task
+			/// @param:   TASKPROFILE * profile - receives the profile
+			/// @return:  zero if successful, nonzero if the task is not registered
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			int GetTaskProfile(Task * task, TASKPROFILE * profile);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// ResetProfile
+			///
+			/// Zero the profile of every task on the ready list.
+			///
+			/// @scope: EXPORTED
+			/// @context: TASK
+			/// @param:   none
+			/// @return:  none
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void ResetProfile(void);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// DumpProfile
+			///
+			/// Print the profile of every task on the ready list, one line each:
+			///
+			///		TP,<name>,<calls>,<total us>,<worst us>,<last us>
+			///
+			/// where name is the Task's SetName name, or its address in hex (the
+			/// function's, for a function task).
+			///
+			/// @scope: EXPORTED
+			/// @context: TASK
+			/// @param:   Print & out - where to print (e.g. Serial)
+			/// @return:  none
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void DumpProfile(Print & out);
+
+			#endif
+
 
 	};
 }
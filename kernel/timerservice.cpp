@@ -0,0 +1,517 @@
+///////////////////////////////////////////////////////////////////////////////
+/// timerservice.cpp
+///
+/// Hardware timer driven software timers
+///
+/// See timerservice.h. Times are held in ticks of the extended Timer2 count,
+/// which wraps every 2^32 ticks, so deadlines are always compared by signed
+/// difference.
+///
+///////////////////////////////////////////////////////////////////////////////
+
+#include "timerservice.h"
+#include "mq.h"
+#include <util/atomic.h>
+
+#define TMR_NONE			0xff				// end of list
+#define TMR_NOMSG			0xff				// timer calls a function
+#define TMR_MARGIN			4					// ticks: closer than this, wait rather than program the compare
+#define TMR_MAX_TICKS		0x7fffffffUL		// longest delay or period
+#define TMR_GEN_MASK		0x7f				// handle: slot generation in the high byte, index in the low
+
+static_assert((F_CPU/1000000UL)*TIMER_TICK_US==TIMER_PRESCALE,"F_CPU must give a whole number of microseconds per Timer2 tick");
+
+#if (TIMER_PRESCALE == 32)
+#define TMR_CLOCK_SELECT	(_BV(CS21)|_BV(CS20))
+#elif (TIMER_PRESCALE == 64)
+#define TMR_CLOCK_SELECT	(_BV(CS22))
+#elif (TIMER_PRESCALE == 128)
+#define TMR_CLOCK_SELECT	(_BV(CS22)|_BV(CS20))
+#elif (TIMER_PRESCALE == 256)
+#define TMR_CLOCK_SELECT	(_BV(CS22)|_BV(CS21))
+#elif (TIMER_PRESCALE == 1024)
+#define TMR_CLOCK_SELECT	(_BV(CS22)|_BV(CS21)|_BV(CS20))
+#else
+#error "TIMER_PRESCALE must be 32, 64, 128, 256 or 1024"
+#endif
+
+namespace Kernel {
+
+	//
+	// one software timer. Running timers are linked by index in deadline
+	// order, free ones into the free list.
+
+	typedef class KTIMER * PKTIMER;
+	class KTIMER {
+		public:
+			unsigned long		Deadline;			// ticks
+			unsigned long		Period;				// ticks, zero if one-shot
+			PFNTIMERCALLBACK	Callback;
+			void *				Context;
+			uint8_t				msgid;				// TMR_NOMSG if Callback is used
+			uint8_t				Next;
+			uint8_t				Gen;				// moves on each time the slot is freed
+	};
+
+	//
+	// service internals
+
+	typedef class TIMERINTERNALS * PTIMERINTERNALS;
+	class TIMERINTERNALS {
+		public:
+			volatile unsigned long	Overflows;		// Timer2 overflows: the top 24 bits of the tick count
+			uint8_t					Head;			// running timers, nearest deadline first
+			uint8_t					Free;
+			boolean					InService;		// Service is running (a callback may start or cancel timers)
+			KTIMER					Timers[TIMER_MAX_TIMERS];
+
+			TIMERINTERNALS() : Overflows(0),Head(TMR_NONE),Free(0),InService(false) {
+				for(uint8_t idx=0;idx<TIMER_MAX_TIMERS;idx++) {
+					Timers[idx].Next=idx+1;
+					Timers[idx].Gen=0;
+				}
+				Timers[TIMER_MAX_TIMERS-1].Next=TMR_NONE;
+			}
+	};
+
+	static TIMERINTERNALS timerInternals;
+
+	KERNEL_RAM(TimerService,sizeof(timerInternals));
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// ReadTicks
+	///
+	/// Read the extended Timer2 count. An overflow that has happened but not yet
+	/// been serviced is allowed for, as micros() does for Timer0.
+	///
+	/// @context:	ANY, interrupts disabled
+	/// @scope:     PRIVATE
+	/// @param:     none
+	/// @return:	unsigned long - ticks
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	static unsigned long ReadTicks(void)
+	{
+		uint8_t low=TCNT2;
+		unsigned long high=timerInternals.Overflows;
+		if((TIFR2 & _BV(TOV2)) && (low<255)) {
+			high++;
+		}
+		return (high<<8)|low;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// UsToTicks
+	///
+	/// Convert microseconds to ticks, rounding up.
+	///
+	/// @context:	ANY
+	/// @scope:     PRIVATE
+	/// @param:     unsigned long us
+	/// @return:	unsigned long - ticks
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	static unsigned long UsToTicks(unsigned long us)
+	{
+		return (us/TIMER_TICK_US)+((us%TIMER_TICK_US)?1:0);
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// Insert
+	///
+	/// Link a timer into the running list after any with the same deadline, so
+	/// timers due together fire in the order they were started.
+	///
+	/// @context:	ANY, interrupts disabled
+	/// @scope:     PRIVATE
+	/// @param:     uint8_t idx - timer index
+	/// @return:	none
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	static void Insert(uint8_t idx)
+	{
+		unsigned long deadline=timerInternals.Timers[idx].Deadline;
+		uint8_t * link=&timerInternals.Head;
+		while((*link!=TMR_NONE) && ((long)(timerInternals.Timers[*link].Deadline-deadline)<=0)) {
+			link=&timerInternals.Timers[*link].Next;
+		}
+		timerInternals.Timers[idx].Next=*link;
+		*link=idx;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// Release
+	///
+	/// Put an unlinked timer back on the free list, invalidating its handle.
+	///
+	/// @context:	ANY, interrupts disabled
+	/// @scope:     PRIVATE
+	/// @param:     uint8_t idx - timer index
+	/// @return:	none
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	static void Release(uint8_t idx)
+	{
+		timerInternals.Timers[idx].Gen=(timerInternals.Timers[idx].Gen+1)&TMR_GEN_MASK;
+		timerInternals.Timers[idx].Next=timerInternals.Free;
+		timerInternals.Free=idx;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// Service
+	///
+	/// Fire every timer that has come due, then program compare A for the next
+	/// deadline if it falls before the next overflow. Otherwise the compare is
+	/// left off and the overflow interrupt calls back here at the start of each
+	/// 256-tick window until the deadline is in range. A timer due within
+	/// TMR_MARGIN ticks is waited for here, as the compare could be missed.
+	///
+	/// @context:	ANY, interrupts disabled
+	/// @scope:     PRIVATE
+	/// @param:     none
+	/// @return:	none
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	static void Service(void)
+	{
+		timerInternals.InService=true;
+		while(timerInternals.Head!=TMR_NONE) {
+			uint8_t idx=timerInternals.Head;
+			PKTIMER pTimer=&timerInternals.Timers[idx];
+			unsigned long now=ReadTicks();
+			long left=(long)(pTimer->Deadline-now);
+
+			if(left>TMR_MARGIN) {
+				if(((pTimer->Deadline^now)&0xffffff00UL)==0) {
+					OCR2A=(uint8_t)pTimer->Deadline;
+					TIFR2=_BV(OCF2A);				// drop any stale match
+					TIMSK2|=_BV(OCIE2A);
+				} else {
+					TIMSK2&=~_BV(OCIE2A);
+				}
+				break;
+			}
+			while(left>0) {
+				now=ReadTicks();
+				left=(long)(pTimer->Deadline-now);
+			}
+
+			// unlink, then re-arm or free before firing, so the callback may
+			// cancel or restart its own timer
+
+			PFNTIMERCALLBACK callback=pTimer->Callback;
+			void * context=pTimer->Context;
+			uint8_t msgid=pTimer->msgid;
+
+			timerInternals.Head=pTimer->Next;
+			if(pTimer->Period) {
+				pTimer->Deadline+=pTimer->Period;
+				if((long)(pTimer->Deadline-now)<=0) {
+					pTimer->Deadline=now+pTimer->Period;
+				}
+				Insert(idx);
+			} else {
+				Release(idx);
+			}
+
+			if(msgid!=TMR_NOMSG) {
+				MQClass::Get().Post(msgid,NULL,MQ_OWNER_CALLER,MQ_CONTEXT_INTERRUPT);
+			} else {
+				callback(context);
+			}
+		}
+		if(timerInternals.Head==TMR_NONE) {
+			TIMSK2&=~_BV(OCIE2A);
+		}
+		timerInternals.InService=false;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// TimerService
+	///
+	/// CONSTRUCTOR, PRIVATE
+	///
+	/// Initialize the timer service. This class should be a singleton within
+	/// the kernel.
+	///
+	/// @scope: 	EXPORTED
+	/// @context: 	TASK
+	/// @param:  	none
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	TimerService::TimerService(void)
+	{
+		this->internals=&timerInternals;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// Get
+	///
+	/// Obtain the singleton class instance
+	///
+	/// @scope: PUBLIC
+	/// @context: ANY
+	/// @param: none
+	/// @return: reference to singleton class
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	static TimerService& TimerService::Get(void)
+	{
+		static TimerService ts;
+		return ts;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// Now
+	///
+	/// The kernel monotonic clock, in microseconds.
+	///
+	/// @scope:	  PUBLIC
+	/// @context: ANY
+	/// @param:   none
+	/// @return:  unsigned long - microseconds
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	static unsigned long TimerService::Now(void)
+	{
+		return NowTicks()*TIMER_TICK_US;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// NowTicks
+	///
+	/// The kernel monotonic clock in raw Timer2 ticks.
+	///
+	/// @scope:	  PUBLIC
+	/// @context: ANY
+	/// @param:   none
+	/// @return:  unsigned long - ticks
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	static unsigned long TimerService::NowTicks(void)
+	{
+		unsigned long ticks;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			ticks=ReadTicks();
+		}
+		return ticks;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// Init
+	///
+	/// Set Timer2 running in normal mode at F_CPU/TIMER_PRESCALE with the
+	/// overflow interrupt on. It stays on, as it keeps the clock. Timer2 is not gated in PRR (see KERNEL_PRR_GATE).
+	///
+	/// @scope:	  PRIVATE
+	/// @context: TASK
+	/// @param:   none
+	/// @return:  none
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TimerService::Init(void)
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			TCCR2B=0;
+			TCCR2A=0;
+			ASSR=0;
+			TCNT2=0;
+			TIFR2=_BV(OCF2A)|_BV(TOV2);
+			TIMSK2=_BV(TOIE2);
+			TCCR2B=TMR_CLOCK_SELECT;
+			Service();
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// StartTimer
+	///
+	/// Common implementation of Start and StartMessage. The first expiry is
+	/// one tick later than asked, since part of the current tick has gone, so it
+	/// is never early.
+	///
+	/// @scope:	  PRIVATE
+	/// @context: ANY
+	/// @return:  int - timer handle, negative if error occurred
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	int TimerService::StartTimer(unsigned long delay, unsigned long period, PFNTIMERCALLBACK callback, void * context, int msgid)
+	{
+		int rc=-1;
+
+		delay=UsToTicks(delay)+1;
+		period=UsToTicks(period);
+
+		if((delay<=TMR_MAX_TICKS) && (period<=TMR_MAX_TICKS)) {
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+				uint8_t idx=timerInternals.Free;
+				if(idx!=TMR_NONE) {
+					PKTIMER pTimer=&timerInternals.Timers[idx];
+					timerInternals.Free=pTimer->Next;
+					pTimer->Deadline=ReadTicks()+delay;
+					pTimer->Period=period;
+					pTimer->Callback=callback;
+					pTimer->Context=context;
+					pTimer->msgid=(uint8_t)msgid;
+					Insert(idx);
+					if(!timerInternals.InService) {
+						Service();
+					}
+					rc=((int)pTimer->Gen<<8)|idx;
+				}
+			}
+		}
+		return rc;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// Start
+	///
+	/// Start a timer that calls a function.
+	///
+	/// @scope:	  PUBLIC
+	/// @context: ANY
+	/// @param:   unsigned long delay - microseconds to the first expiry
+	/// @param:   unsigned long period - microseconds between expiries, zero for one-shot
+	/// @param:   PFNTIMERCALLBACK callback
+	/// @param:   void * context - passed to the callback
+	/// @return:  int - timer handle for Cancel, negative if no timer is free
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	int TimerService::Start(unsigned long delay, unsigned long period, PFNTIMERCALLBACK callback, void * context)
+	{
+		int rc=-1;
+		if(callback) {
+			rc=StartTimer(delay,period,callback,context,TMR_NOMSG);
+		}
+		return rc;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// StartMessage
+	///
+	/// Start a timer that posts a message.
+	///
+	/// @scope:	  PUBLIC
+	/// @context: ANY
+	/// @param:   int msgid - message ID to post
+	/// @param:   unsigned long delay - microseconds to the first expiry
+	/// @param:   unsigned long period - microseconds between expiries, zero for one-shot
+	/// @return:  int - timer handle for Cancel, negative if error occurred
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	int TimerService::StartMessage(int msgid, unsigned long delay, unsigned long period)
+	{
+		int rc=-1;
+		if((msgid>=0) && (msgid<MSG_MAX_MSG_IDS)) {
+			rc=StartTimer(delay,period,NULL,NULL,msgid);
+		}
+		return rc;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// Cancel
+	///
+	/// Stop a timer. The handle's generation must match the slot's, so a stale
+	/// handle to a slot since reused stops nothing.
+	///
+	/// @scope:	  PUBLIC
+	/// @context: ANY
+	/// @param:   int timer - handle from Start or StartMessage
+	/// @return:  zero if successful, nonzero if the timer was not running
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	int TimerService::Cancel(int timer)
+	{
+		int rc=-1;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			uint8_t * link=&timerInternals.Head;
+			while(*link!=TMR_NONE) {
+				uint8_t idx=*link;
+				if((timer>=0) && (idx==(timer&0xff)) && (timerInternals.Timers[idx].Gen==((timer>>8)&TMR_GEN_MASK))) {
+					*link=timerInternals.Timers[idx].Next;
+					Release(idx);
+					rc=0;
+					break;
+				}
+				link=&timerInternals.Timers[idx].Next;
+			}
+			if(!timerInternals.InService) {
+				Service();
+			}
+		}
+		return rc;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// CancelMessage
+	///
+	/// Stop every timer that posts msgid.
+	///
+	/// @scope:	  PUBLIC
+	/// @context: ANY
+	/// @param:   int msgid - message ID
+	/// @return:  int - number of timers stopped
+	///
+	///////////////////////////////////////////////////////////////////////////////
+
+	int TimerService::CancelMessage(int msgid)
+	{
+		int count=0;
+		if((msgid>=0) && (msgid<MSG_MAX_MSG_IDS)) {
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+				uint8_t * link=&timerInternals.Head;
+				while(*link!=TMR_NONE) {
+					uint8_t idx=*link;
+					if(timerInternals.Timers[idx].msgid==msgid) {
+						*link=timerInternals.Timers[idx].Next;
+						Release(idx);
+						count++;
+					} else {
+						link=&timerInternals.Timers[idx].Next;
+					}
+				}
+				if(!timerInternals.InService) {
+					Service();
+				}
+			}
+		}
+		return count;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Timer2 interrupts
+///
+/// The overflow extends the count, every 256 ticks whether a timer is running
+/// or not, and with one running brings the next window into range; compare A
+/// is a deadline.
+///
+///////////////////////////////////////////////////////////////////////////////
+
+ISR(TIMER2_OVF_vect)
+{
+	Kernel::timerInternals.Overflows++;
+	if(Kernel::timerInternals.Head!=TMR_NONE) {
+		Kernel::Service();
+	}
+}
+
+ISR(TIMER2_COMPA_vect)
+{
+	Kernel::Service();
+}
@@ -0,0 +1,242 @@
+///////////////////////////////////////////////////////////////////////////////
+/// timerservice.h
+///
+/// Hardware timer driven software timers
+///
+/// Timer2 runs free at F_CPU/32 (2us a tick at 16MHz) and its overflow
+/// interrupt extends the 8-bit count to 32 bits. Software timers are kept on
+/// a list ordered by deadline, and compare A is only programmed when the
+/// nearest deadline falls before the next overflow: a timer fires from the
+/// compare interrupt within a few microseconds of its deadline, whatever the
+/// tasks are doing.
+///
+/// The service is not tickless. The overflow interrupt that keeps the clock
+/// runs every 256 ticks (512us at 16MHz) whether or not a timer is running,
+/// about twice the rate of the Arduino core's Timer0 tick, and each one ends
+/// an idle sleep (see KERNEL_IDLE_SLEEP). With no timer running it only
+/// counts, a few microseconds a time. A build that would rather sleep longer
+/// than measure finely can set TIMER_PRESCALE higher: at 1024 the overflow
+/// comes every 16ms, and the clock and timers have 64us resolution.
+///
+/// On expiry a timer either calls a callback, in interrupt context, or posts
+/// a message (with a NULL context) to the message queue.
+///
+/// The same count is the kernel's monotonic clock (Now), which the kernel
+/// uses in place of micros() for all its scheduling and measurement.
+///
+/// Timer2 is taken over from the Arduino core, so analogWrite on pins 3 and
+/// 11 is not available.
+///
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef _TIMERSERVICE_H_
+#define _TIMERSERVICE_H_
+
+#include "sysincs.h"
+
+typedef void (*PFNTIMERCALLBACK)(void * context);
+
+//
+// TIMER_MAX_TIMERS is the number of software timers, including those behind
+// MQClass::PostDelayed and PostPeriodic, that can be running at once.
+
+#ifndef TIMER_MAX_TIMERS
+#define TIMER_MAX_TIMERS		8
+#endif
+
+#if (TIMER_MAX_TIMERS > 254)
+#error "TIMER_MAX_TIMERS must be no greater than 254"
+#endif
+
+//
+// Timer2 prescaler (32, 64, 128, 256 or 1024), and the length of one tick in
+// microseconds. The overflow comes every 256 ticks.
+
+#ifndef TIMER_PRESCALE
+#define TIMER_PRESCALE			32
+#endif
+
+#define TIMER_TICK_US			(TIMER_PRESCALE/(F_CPU/1000000UL))
+
+namespace Kernel {
+
+	class TimerService {
+
+		private:
+
+			friend void ::setup();		// the timer hardware is set up after the Arduino core's init()
+
+			// internals
+
+			void *	internals;
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// TimerService
+			///
+			/// CONSTRUCTOR, PRIVATE
+			///
+			/// Initialize the timer service. This class should be a singleton within
+			/// the kernel.
+			///
+			/// @scope: 	EXPORTED
+			/// @context: 	TASK
+			/// @param:  	none
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			TimerService(void);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// Init
+			///
+			/// Set Timer2 running for the service. Called from setup(), after the
+			/// Arduino core has set it up for PWM. Timers may be started before this;
+			/// they count from when it is called.
+			///
+			/// @scope:	  PRIVATE
+			/// @context: TASK
+			/// @param:   none
+			/// @return:  none
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			void Init(void);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// StartTimer
+			///
+			/// Common implementation of Start and StartMessage.
+			///
+			/// @scope:	  PRIVATE
+			/// @context: ANY
+			/// @return:  int - timer handle, negative if error occurred
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			int StartTimer(unsigned long delay, unsigned long period, PFNTIMERCALLBACK callback, void * context, int msgid);
+
+		public:
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// Get
+			///
+			/// Return the singleton class
+			///
+			/// @context: ANY
+			/// @scope: PUBLIC
+			/// @param: none
+			/// @return: reference to single instance of static class
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			static TimerService& Get(void);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// Now
+			///
+			/// The kernel monotonic clock, in microseconds, with TIMER_TICK_US (2us by
+			/// default) resolution. Like micros() it wraps every 2^32us (about 71 minutes), so
+			/// compare times by unsigned subtraction: (Now()-start) is correct across
+			/// the wrap for any interval shorter than that. Stands still until the
+			/// service is initialised in setup().
+			///
+			/// @scope:	  PUBLIC
+			/// @context: ANY
+			/// @param:   none
+			/// @return:  unsigned long - microseconds
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			static unsigned long Now(void);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// NowTicks
+			///
+			/// The kernel monotonic clock in raw Timer2 ticks (F_CPU/TIMER_PRESCALE).
+			///
+			/// @scope:	  PUBLIC
+			/// @context: ANY
+			/// @param:   none
+			/// @return:  unsigned long - ticks
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			static unsigned long NowTicks(void);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// Start
+			///
+			/// Start a timer that calls a function once delay microseconds have passed,
+			/// and then every period microseconds if period is nonzero. Times are
+			/// rounded up to whole ticks, and may be up to about 71 minutes.
+			///
+			/// The callback runs in interrupt context with interrupts disabled: it must
+			/// be short, and may only use ISR-safe calls (posting a message with
+			/// MQ_CONTEXT_INTERRUPT, Task::Signal, and the functions of this class).
+			/// A periodic timer keeps to its original grid; if the callbacks fall
+			/// more than a period behind, the grid restarts from the late one.
+			///
+			/// @scope:	  PUBLIC
+			/// @context: ANY
+			/// @param:   unsigned long delay - microseconds to the first expiry
+			/// @param:   unsigned long period - microseconds between expiries, zero for one-shot
+			/// @param:   PFNTIMERCALLBACK callback
+			/// @param:   void * context - passed to the callback
+			/// @return:  int - timer handle for Cancel, negative if no timer is free
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			int Start(unsigned long delay, unsigned long period, PFNTIMERCALLBACK callback, void * context);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// StartMessage
+			///
+			/// As Start, but post msgid, with a NULL context, on each expiry instead of
+			/// calling a function. The message is posted from the interrupt, so it is
+			/// dispatched on the next pass of the kernel loop.
+			///
+			/// @scope:	  PUBLIC
+			/// @context: ANY
+			/// @param:   int msgid - message ID to post
+			/// @param:   unsigned long delay - microseconds to the first expiry
+			/// @param:   unsigned long period - microseconds between expiries, zero for one-shot
+			/// @return:  int - timer handle for Cancel, negative if error occurred
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			int StartMessage(int msgid, unsigned long delay, unsigned long period);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// Cancel
+			///
+			/// Stop a timer. A handle carries the generation of its timer slot, which
+			/// moves on whenever the slot is freed, so cancelling a one-shot timer that
+			/// has already fired is harmless even if the slot has since been reused.
+			///
+			/// @scope:	  PUBLIC
+			/// @context: ANY
+			/// @param:   int timer - handle from Start or StartMessage
+			/// @return:  zero if successful, nonzero if the timer was not running
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			int Cancel(int timer);
+
+			///////////////////////////////////////////////////////////////////////////////
+			/// CancelMessage
+			///
+			/// Stop every timer that posts msgid. A message already posted to the
+			/// queue is not recalled.
+			///
+			/// @scope:	  PUBLIC
+			/// @context: ANY
+			/// @param:   int msgid - message ID
+			/// @return:  int - number of timers stopped
+			///
+			///////////////////////////////////////////////////////////////////////////////
+
+			int CancelMessage(int msgid);
+	};
+}
+
+#endif
@@ -0,0 +1,225 @@
+///////////////////////////////////////////////////////////////////////////////
+/// watchdog.cpp
+///
+/// Task watchdog
+///
+/// The AVR watchdog timer in interrupt-then-reset mode, the per-task heartbeat
+/// and overrun checks, and the reset record kept in the on-chip EEPROM. See
+/// KernelClass.h.
+///
+///////////////////////////////////////////////////////////////////////////////
+
+#include "kernel.h"
+
+#if TASK_WATCHDOG
+
+#include <avr/wdt.h>
+#include <avr/eeprom.h>
+
+namespace Kernel {
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// WatchdogBoot
+	///
+	/// After a watchdog reset the WDT stays enabled, at its shortest period, until
+	/// WDRF is cleared. Without a bootloader to do it, that would reset the
+	/// device again before setup() is reached, so clear it first thing.
+	///
+	/// @context:	RESET
+	/// @scope:     PRIVATE
+	/// @param:     none
+	/// @return:	none
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	static void WatchdogBoot(void) __attribute__((naked,used,section(".init3")));
+	static void WatchdogBoot(void)
+	{
+		MCUSR=0;
+		wdt_disable();
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// WatchdogInit
+	///
+	/// Start the watchdog timer in interrupt-then-reset mode, and report the
+	/// reset record left by a previous watchdog reset. A provisional hang
+	/// record still in place means the reset did follow it, so it becomes the
+	/// reset record.
+	///
+	/// @context:	TASK
+	/// @scope:     PRIVATE
+	/// @param:     none
+	/// @return:	none
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	void KernelClass::WatchdogInit(void)
+	{
+		KRESETRECORD record;
+
+		eeprom_read_block(&record,(const void *)(KERNEL_WDT_PENDING_EEADDR),sizeof(record));
+		if(record.Magic==KRESET_MAGIC) {
+			eeprom_update_block(&record,(void *)(KERNEL_WDT_EEADDR),sizeof(record));
+			eeprom_update_byte((uint8_t *)(KERNEL_WDT_PENDING_EEADDR),0xff);
+		}
+
+		if(WatchdogOut && GetResetRecord(&record)) {
+			WatchdogOut->print(F("WD,RESET,"));
+			WatchdogOut->print((unsigned int)record.Reason);
+			WatchdogOut->print(',');
+			WatchdogOut->print((unsigned int)record.Count);
+			WatchdogOut->print(',');
+			for(uint8_t idx=0;(idx<sizeof(record.Name)) && record.Name[idx];idx++) {
+				WatchdogOut->print(record.Name[idx]);
+			}
+			WatchdogOut->print(',');
+			WatchdogOut->println(record.Uptime);
+		}
+
+		wdt_enable(KERNEL_WDT_TIMEOUT);
+		WDTCSR|=_BV(WDIE);						// interrupt first, reset on the next timeout
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// WatchdogService
+	///
+	/// Kick the watchdog timer and check the watched tasks. If the WDT
+	/// interrupt fired (the hardware cleared WDIE) loop() has recovered from
+	/// the stall before the reset: drop the provisional hang record and re-arm
+	/// the interrupt. A starved task is logged and recorded, then the device is
+	/// reset: the WDT is set to its shortest period with the interrupt off, and
+	/// left to expire.
+	///
+	/// @context:	TASK
+	/// @scope:     PRIVATE
+	/// @param:     none
+	/// @return:	none
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	void KernelClass::WatchdogService(void)
+	{
+		PTASKNODE pStarved;
+
+		wdt_reset();
+		if(!(WDTCSR & _BV(WDIE))) {
+			eeprom_update_byte((uint8_t *)(KERNEL_WDT_PENDING_EEADDR),0xff);
+			WDTCSR|=_BV(WDIE);
+		}
+
+		pStarved=TaskManager.Watch(millis(),WatchdogOut);
+		if(pStarved) {
+			if(WatchdogOut) {
+				char name[sizeof(((KRESETRECORD *)0)->Name)+1];
+				TaskManager.GetName(pStarved,name,sizeof(name)-1);
+				name[sizeof(name)-1]='\0';
+				WatchdogOut->print(F("WD,STARVED,"));
+				WatchdogOut->println(name);
+				WatchdogOut->flush();
+			}
+			RecordReset(KRESET_STARVED,pStarved,false);
+			wdt_enable(WDTO_15MS);
+			for(;;);
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// RecordReset
+	///
+	/// Write the reset record to EEPROM, counting on from the previous one.
+	/// eeprom_update_block only writes the bytes that change, at about 3.4ms
+	/// each, well inside the WDT period left after the interrupt.
+	///
+	/// @context:	ANY
+	/// @scope:     PRIVATE
+	/// @param:     uint8_t reason - KRESET_*
+	/// @param:     PTASKNODE pTask - the task responsible, NULL if none
+	/// @param:     boolean pending - write the provisional record instead
+	/// @return:	none
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	void KernelClass::RecordReset(uint8_t reason, PTASKNODE pTask, boolean pending)
+	{
+		KRESETRECORD record;
+		uint8_t count=0;
+
+		if(GetResetRecord(&record)) {
+			count=record.Count;
+		}
+		record.Magic=KRESET_MAGIC;
+		record.Reason=reason;
+		record.Count=(count<0xff)?count+1:count;
+		record.Task=pTask?(uint16_t)(uintptr_t)pTask->Owner:0;
+		TaskManager.GetName(pTask,record.Name,sizeof(record.Name));
+		record.Uptime=millis();
+		eeprom_update_block(&record,(void *)(pending?KERNEL_WDT_PENDING_EEADDR:KERNEL_WDT_EEADDR),sizeof(record));
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// GetResetRecord
+	///
+	/// Read the record of the last watchdog reset from EEPROM.
+	///
+	/// @context:	TASK
+	/// @scope:     PUBLIC
+	/// @param:     KRESETRECORD * record - receives the record
+	/// @return:	boolean - true if there is a record
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	boolean KernelClass::GetResetRecord(KRESETRECORD * record)
+	{
+		boolean valid=false;
+		if(record) {
+			eeprom_read_block(record,(const void *)(KERNEL_WDT_EEADDR),sizeof(*record));
+			valid=(record->Magic==KRESET_MAGIC);
+		}
+		return valid;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// ClearResetRecord
+	///
+	/// Erase the reset record, and with it the reset count.
+	///
+	/// @context:	TASK
+	/// @scope:     PUBLIC
+	/// @param:     none
+	/// @return:	none
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	void KernelClass::ClearResetRecord(void)
+	{
+		eeprom_update_byte((uint8_t *)(KERNEL_WDT_EEADDR),0xff);
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	/// WatchdogExpired
+	///
+	/// loop() has not kicked the watchdog for a whole period: record a hang
+	/// against whichever task was running. The hardware has already cleared
+	/// WDIE, so the next timeout resets the device; until then the record is
+	/// provisional, and WatchdogService drops it if loop() gets going again.
+	///
+	/// @context:	INTERRUPT
+	/// @scope:     INTERNAL
+	/// @param:     none
+	/// @return:	none
+	///
+	//////////////////////////////////////////////////////////////////////////////
+
+	void KernelClass::WatchdogExpired(void)
+	{
+		RecordReset(KRESET_HANG,TaskManager.Running(),true);
+	}
+}
+
+ISR(WDT_vect)
+{
+	Kernel::OS.WatchdogExpired();
+}
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef _MSGIDS_H_
 #define _MSGIDS_H_
 
+#include <stdint.h>
+
 #define MSG_ID_UPDATE_7SEG	1
 #define MSG_ID_KEY_PRESSED  2
 #define MSG_ID_KEY_RELEASED	3
@@ -14,4 +16,22 @@
 #define MSG_ID_DATALOG_DELETELOG	9
 #define MSG_ID_DATALOG_DUMPLOG		10
 
+// timer messages, posted from interrupt context by the Timer2 timer service
+// (PostDelayed/PostPeriodic)
+#define MSG_ID_KEY_DEBOUNCED		12
+
+// IIC completion, posted by the kernel IIC engine with the IICXFER as context
+#define MSG_ID_E2_DONE				13
+
+// Payloads are posted inline with Post<T>:
+//   MSG_ID_UPDATE_7SEG, MSG_ID_KEY_PRESSED         uint8_t key value
+//   MSG_ID_NEW_ACTUAL_RPS, MSG_ID_NEW_RPS_ENTERED  uint16_t rps
+//   MSG_ID_DATALOG_LOGEVENT                        DATALOG_EVENT
+
+struct DATALOG_EVENT
+{
+  uint16_t demand_rps;
+  uint16_t actual_rps;
+};
+
 #endif
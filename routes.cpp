@@ -0,0 +1,65 @@
+/// Compile-time message routes for the application. Every subscriber in this
+/// firmware is fixed at build time, so rather than subscribing at runtime
+/// (which costs a heap node per subscription and a list walk per message) the
+/// routes are described here and resolved by the compiler into a table in
+/// flash. UserInit attaches the table to the message queue.
+
+#include <mqroute.h>
+#include "display.h"
+#include "LogTask.h"
+#include "KeypadTask.h"
+
+extern LogTask logger;
+extern Control control;
+extern KeypadTask keypad;
+extern Display lc_display;
+extern SevenSegEventHandler seven_segment;
+
+
+MQ_ROUTE(MSG_ID_UPDATE_7SEG)
+{
+  MQ_ROUTE_TO(seven_segment);
+}
+
+MQ_ROUTE(MSG_ID_KEY_PRESSED)
+{
+  MQ_ROUTE_TO(lc_display);
+}
+
+MQ_ROUTE(MSG_ID_INIT_COMPLETE)
+{
+  MQ_ROUTE_TO(lc_display);
+}
+
+MQ_ROUTE(MSG_ID_NEW_ACTUAL_RPS)
+{
+  MQ_ROUTE_TO(lc_display);
+}
+
+MQ_ROUTE(MSG_ID_NEW_RPS_ENTERED)
+{
+  MQ_ROUTE_TO(control);
+}
+
+MQ_ROUTE(MSG_ID_KEY_DEBOUNCED)
+{
+  MQ_ROUTE_TO(keypad);
+}
+
+MQ_ROUTE(MSG_ID_DATALOG_LOGEVENT)
+{
+  MQ_ROUTE_TO(logger);
+}
+
+MQ_ROUTE(MSG_ID_DATALOG_DELETELOG)
+{
+  MQ_ROUTE_TO(logger);
+}
+
+MQ_ROUTE(MSG_ID_DATALOG_DUMPLOG)
+{
+  MQ_ROUTE_TO(logger);
+}
+
+
+MQ_ROUTE_TABLE(AppRoutes);